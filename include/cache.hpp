@@ -0,0 +1,39 @@
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <tex.hpp>
+#include <types.hpp>
+#include <vector>
+
+// identity of a file as of hashing: same inode, size and timestamps means same content
+struct input_t {
+  std::filesystem::path path;
+  u64 dev, ino, size, mtime, ctime;
+
+  bool operator==(const input_t &) const = default;
+};
+
+// a build state, `inputs` is what `digest` was computed from
+struct state_t {
+  std::string digest;
+  std::vector<input_t> inputs;
+};
+
+// build outputs keyed by the contents of everything a root pulls in, so that undoing a change or switching
+// back to a branch restores the pdf instead of compiling it again
+namespace cache {
+void init(std::filesystem::path directory, u64 limit);
+bool enabled(void);
+// only files changed since the previous call are read again
+state_t key(const std::filesystem::path &root, const graph_t &deps, std::string_view backend);
+bool restore(const state_t &key, const std::filesystem::path &root, const std::filesystem::path &workdir);
+// does nothing when an input changed after the key was computed, the outputs may not match it
+void store(const state_t &key, const std::filesystem::path &root, const std::filesystem::path &workdir);
+} // namespace cache
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef CGROUP_HPP
+#define CGROUP_HPP
+
+#pragma once
+
+#ifndef __linux__
+#error "cgroup.hpp is only available on Linux"
+#endif
+
+#include <types.hpp>
+
+struct usage_t {
+  u64 memory; // peak, bytes
+  u64 cpu;    // user + system, microseconds
+};
+
+// compile jobs in a delegated cgroup v2 subtree: the watcher moves to `<own>/watcher`, jobs get a leaf each
+// below `<own>/jobs`, which carries the limits from the options
+namespace cgroup {
+bool init(void);
+bool enabled(void);
+// directory fd of a fresh leaf, for CLONE_INTO_CGROUP, -1 when cgroups are not available
+i32 enter(void);
+// kills everything still in the leaf, descendants of the compiler included
+void kill(i32 fd);
+// the leaf is removed once empty, from the reactor when killed processes are still exiting
+usage_t leave(i32 fd);
+// waits a little for the leaves still draining
+void deinit(void);
+} // namespace cgroup
+
+#endif
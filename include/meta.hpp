@@ -0,0 +1,35 @@
+#ifndef META_HPP
+#define META_HPP
+
+#pragma once
+
+#ifndef __linux__
+#error "meta.hpp is only available on Linux"
+#endif
+
+#include <filesystem>
+#include <types.hpp>
+
+// what the analyzer asks the filesystem about, cached under interned paths and dropped again by the watcher's
+// events. only directories the watcher reports every change of are cached, anything else goes to the kernel each time
+namespace meta {
+enum class kind_t : u8 { missing, regular, directory, other };
+
+struct entry_t {
+  kind_t kind;
+  // realpath of the file, or of its longest existing prefix when missing
+  std::filesystem::path canonical;
+};
+
+// kept in step with the watches: `full` when creations, deletions and renames are all reported
+void watch(const std::filesystem::path &directory, bool full);
+// the entries below the directory go along
+void unwatch(const std::filesystem::path &directory);
+// safe to call from several threads
+entry_t lookup(const std::filesystem::path &path);
+// `path` and everything below it, along with the paths that resolve there through symlinks
+void invalidate(const std::filesystem::path &path);
+void clear(void);
+} // namespace meta
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef OPTIONS_HPP
+#define OPTIONS_HPP
+
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <types.hpp>
+
+// where change notifications come from, `automatic` polls on filesystems inotify is blind to
+enum class backend_t : u8 { automatic, inotify, poll };
+
+struct options_t {
+  std::filesystem::path root;
+  // build artifacts go here instead of next to the sources, only the pdf is copied back
+  std::optional<std::filesystem::path> outdir;
+  // chapters are compiled alone through \includeonly first, the full build follows at low priority
+  bool preview;
+  // size cap of the build output cache in bytes, 0 when disabled
+  u64 cache;
+  std::filesystem::path cachedir;
+  // resources granted to compile jobs, 0 when unset; scheduling classes stand in where cgroups are not delegated
+  bool isolate;
+  std::optional<std::string> cpu_max;
+  u64 cpu_weight, memory_high, io_weight;
+  // per file event counters are written here periodically
+  std::optional<std::filesystem::path> stats;
+  // chrome trace-event JSON of the whole run, written on exit
+  std::optional<std::filesystem::path> trace;
+  // raw inotify stream dumped to a file, or read back from one instead of watching, as fast as possible with `asap`
+  std::optional<std::filesystem::path> record, replay;
+  bool asap;
+  // watches follow the dependency graph instead of covering every directory
+  bool sparse;
+  backend_t backend;
+};
+
+namespace options {
+void parse(int argc, char *argv[]);
+const options_t &get(void);
+} // namespace options
+
+#endif
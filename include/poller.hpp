@@ -0,0 +1,62 @@
+#ifndef POLLER_HPP
+#define POLLER_HPP
+
+#pragma once
+
+#ifndef __linux__
+#error "poller.hpp is only available on Linux"
+#endif
+
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <queue>
+#include <string>
+#include <types.hpp>
+#include <uring.hpp>
+#include <vector>
+#include <watcher.hpp>
+
+// what a file is compared by between scans
+struct stamp_t {
+  u64 ino;
+  u64 size;
+  u64 mtime; // nanoseconds
+  bool operator==(const stamp_t &) const = default;
+};
+
+// stat polling for filesystems inotify does not see changes on (NFS, SSHFS, 9p bind mounts), it reports the same
+// events as inotify would, synthesized from the differences between scans
+class poller_t {
+private:
+  struct directory_t {
+    stamp_t stamp; // relisted only when the directory itself changes
+    std::map<std::string, stamp_t> files;
+    std::map<std::string, bool> entries; // name, is a directory
+    u64 interval, due;                   // nanoseconds, quiet directories are scanned less and less often
+  };
+  i32 timer;
+  uring_t ring;
+  std::map<std::filesystem::path, directory_t> directories;
+  u64 scans, cpu;
+
+  void stat(const std::vector<std::filesystem::path> &paths, std::vector<std::optional<stamp_t>> &stamps);
+  void list(const std::filesystem::path &path, directory_t &directory, std::queue<event_t> *events);
+  void arm(void);
+
+public:
+  poller_t(void);
+  ~poller_t(void);
+  poller_t(const poller_t &)            = delete;
+  poller_t &operator=(const poller_t &) = delete;
+  // a single directory, subdirectories are added by the caller. what it already holds is reported to `events`, when
+  // given, as created and written
+  void add(const std::filesystem::path &path, std::queue<event_t> *events = nullptr);
+  void remove(const std::filesystem::path &path);
+  i32 handle(void) const;
+  // scans the directories that are due, false when nothing changed
+  bool scan(std::queue<event_t> &events);
+  void report(void) const;
+};
+
+#endif
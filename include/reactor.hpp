@@ -0,0 +1,24 @@
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+#pragma once
+
+#ifndef __linux__
+#error "reactor.hpp is only available on Linux"
+#endif
+
+#include <functional>
+#include <types.hpp>
+
+// receives the epoll events of the fd, it may be woken up spuriously
+typedef std::function<void(u32 events)> handler_t;
+
+// single threaded event loop, every fd the process waits on goes through here
+namespace reactor {
+void watch(i32 fd, handler_t handler);
+void unwatch(i32 fd);
+void run(void);
+void stop(void);
+} // namespace reactor
+
+#endif
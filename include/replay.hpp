@@ -0,0 +1,41 @@
+#ifndef REPLAY_HPP
+#define REPLAY_HPP
+
+#pragma once
+
+#ifndef __linux__
+#error "replay.hpp is only available on Linux"
+#endif
+
+extern "C" {
+#include <sys/inotify.h>
+}
+#include <filesystem>
+#include <functional>
+#include <queue>
+#include <string_view>
+#include <types.hpp>
+#include <watcher.hpp>
+
+// raw inotify streams dumped to a binary file, and fed back through the pipeline later against a stub compiler
+namespace replay {
+// recorder, the hooks do nothing unless recording
+void record(const std::filesystem::path &file, const std::filesystem::path &root);
+void watched(i32 wd, const std::filesystem::path &path);
+void observed(const struct inotify_event *event);
+// player, paths below the recorded root are moved below `root`; `idle` tells when the pipeline has settled once
+// the trace is exhausted, the report is printed and the reactor stopped then
+void play(const std::filesystem::path &file, const std::filesystem::path &root, bool asap,
+          std::function<bool(void)> idle);
+bool playing(void);
+// timerfd standing in for the inotify fd
+i32 handle(void);
+// moves the events that are due into `events`, false when there were none
+bool due(std::queue<event_t> &events);
+// latency of a pipeline stage and occurrences of something, collected while playing
+void sample(std::string_view stage, u64 ns);
+void tally(std::string_view what);
+void finish(void);
+} // namespace replay
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef SHA256_HPP
+#define SHA256_HPP
+
+#pragma once
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <types.hpp>
+
+// FIPS 180-4 SHA-256, content addresses have to survive adversarial inputs
+class sha256_t {
+private:
+  std::array<u32, 8> state;
+  std::array<u8, 64> block;
+  u64 length;
+
+  void compress(const u8 *data);
+
+public:
+  sha256_t(void);
+  void add(const void *data, u64 size);
+  void add(std::string_view str);
+  std::array<u8, 32> digest(void);
+  std::string hex(void);
+};
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef SLURP_HPP
+#define SLURP_HPP
+
+#pragma once
+
+#ifndef __linux__
+#error "slurp.hpp is only available on Linux"
+#endif
+
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <types.hpp>
+#include <vector>
+
+// `path` is the element of the loaded vector, `content` is writable and NUL terminated at `size`, it is only valid
+// during the call
+typedef std::function<void(const std::filesystem::path &path, char *content, u64 size)> consumer_t;
+
+namespace slurp {
+// reads all `paths` in batches through io_uring (mmap as fallback), handing each one over as soon as it is loaded.
+// once `stop` is set no further file is started
+void load(const std::vector<std::filesystem::path> &paths, const consumer_t &consume,
+          const std::atomic<bool> *stop = nullptr);
+} // namespace slurp
+
+#endif
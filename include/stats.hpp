@@ -0,0 +1,62 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#pragma once
+
+#ifndef __linux__
+#error "stats.hpp is only available on Linux"
+#endif
+
+extern "C" {
+#include <sys/inotify.h>
+}
+#include <array>
+#include <atomic>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <types.hpp>
+#include <vector>
+
+inline constexpr u32 FLAGS[] = {
+  IN_ACCESS,    IN_ATTRIB,      IN_CLOSE_WRITE, IN_CLOSE_NOWRITE, IN_CREATE,   IN_DELETE,  IN_DELETE_SELF, IN_MODIFY,
+  IN_MOVE_SELF, IN_MOVED_FROM,  IN_MOVED_TO,    IN_OPEN,          IN_IGNORED,  IN_ISDIR,   IN_Q_OVERFLOW,  IN_UNMOUNT,
+  IN_ONLYDIR,   IN_DONT_FOLLOW, IN_EXCL_UNLINK, IN_MASK_CREATE,   IN_MASK_ADD, IN_ONESHOT,
+};
+inline constexpr std::string_view FLAGSSTR[] = {
+  "ACCESS",    "ATTRIB",      "CLOSE_WRITE", "CLOSE_NOWRITE", "CREATE",   "DELETE",  "DELETE_SELF", "MODIFY",
+  "MOVE_SELF", "MOVED_FROM",  "MOVED_TO",    "OPEN",          "IGNORED",  "ISDIR",   "Q_OVERFLOW",  "UNMOUNT",
+  "ONLYDIR",   "DONT_FOLLOW", "EXCL_UNLINK", "MASK_CREATE",   "MASK_ADD", "ONESHOT",
+};
+static_assert(sizeof(FLAGS) / sizeof(*FLAGS) == sizeof(FLAGSSTR) / sizeof(*FLAGSSTR));
+inline constexpr u64 NFLAGS = sizeof(FLAGS) / sizeof(*FLAGS);
+
+// position of each flag in FLAGS by bit, every flag is a single bit
+inline constexpr auto SLOTS = [] {
+  std::array<u8, 32> slots{};
+  slots.fill(NFLAGS);
+  for (u8 i = 0; i < NFLAGS; i++) slots[__builtin_ctz(FLAGS[i])] = i;
+  return slots;
+}();
+constexpr u8 slot_of(u32 flag) { return SLOTS[__builtin_ctz(flag)]; }
+
+// one row of the table, laid out for readers mapping the segment from another process
+struct alignas(64) record_t {
+  std::atomic<u64> id; // hash of the path, 0 while free; `name` tells colliding paths apart
+  std::atomic<u64> count[NFLAGS];
+  char name[256]; // truncated path, written once after the id is claimed
+};
+
+// per file event counters in a flat table shared as `/dev/shm/watchtex-stats-<pid>`, updated without locks
+namespace stats {
+void init(std::optional<std::filesystem::path> snapshot);
+void deinit(void);
+// nullptr when the table is full
+const record_t *update(const std::filesystem::path &path, u32 mask);
+void snapshot(void);
+// claimed rows, sorted by path
+std::vector<const record_t *> records(void);
+} // namespace stats
+
+#endif
@@ -4,14 +4,43 @@
 #pragma once
 
 #include <filesystem>
+#include <functional>
 #include <map>
 #include <set>
+#include <types.hpp>
 
-typedef std::map<std::filesystem::path, std::set<std::filesystem::path>> graph_t;
+// how a file is pulled in, it decides which stages have to run again when the file changes
+enum class dep_t : u8 {
+  input,        // \input
+  include,      // \include
+  bibliography, // \bibliography, \addbibresource
+  style,        // \usepackage, \documentclass of a local .sty/.cls
+  graphic,      // \includegraphics
+  listing,      // \lstinputlisting
+};
+
+typedef std::map<std::filesystem::path, std::map<std::filesystem::path, dep_t>> graph_t;
 
 namespace tex {
 void analyze(std::filesystem::path path, graph_t &deps, graph_t &roots);
-void build(const std::filesystem::path &path, const graph_t &deps, const graph_t &roots);
+// analyzes `path` on a background thread, the graphs are filled from the event loop once it is done, then `done`
+// is called
+void survey(std::filesystem::path path, graph_t &deps, graph_t &roots, std::function<void(void)> done);
+bool ready(void);
+// inputs that gained or lost users since the last call
+std::set<std::filesystem::path> touched(void);
+// before the survey is merged: sources that may pull `path` in, not analyzed yet. best effort, only the directories
+// from `path` up to `top` and their direct subdirectories are searched, includers further away are left to the survey
+void analyze_ancestors(const std::filesystem::path &path, const std::filesystem::path &top, graph_t &deps,
+                       graph_t &roots);
+// whether the source starts a document of its own, rather than being a fragment pulled in by one
+bool standalone(const std::filesystem::path &path);
+// suffix of something commands pull in
+bool trackable(const std::filesystem::path &path);
+void build(const std::set<std::filesystem::path> &paths, const graph_t &deps, const graph_t &roots);
+// compile jobs still running
+bool busy(void);
+void cancel(void);
 } // namespace tex
 
-#endif
\ No newline at end of file
+#endif
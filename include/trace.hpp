@@ -0,0 +1,58 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <types.hpp>
+
+// static tracepoints under the `watchtex` provider, a nop in the binary until bpftrace or perf attaches to them
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(watchtex, name __VA_OPT__(, ) __VA_ARGS__)
+#else
+#define PROBE(name, ...) ((void)0)
+#endif
+
+// `<name>__start` probe now and `<name>__end` when the scope is left, recorded as a span while tracing
+#define TRACE_SPAN(name, ...)                     \
+  PROBE(name##__start __VA_OPT__(, ) __VA_ARGS__); \
+  trace::span_t trace_span_##name(#name, [] { PROBE(name##__end); })
+
+// single probe, recorded as an instant event while tracing
+#define TRACE_EVENT(name, ...)                                                \
+  do {                                                                        \
+    PROBE(name __VA_OPT__(, ) __VA_ARGS__);                                   \
+    if (trace::active.load(std::memory_order_relaxed)) trace::instant(#name); \
+  } while (0)
+
+// in process recorder writing Chrome trace-event JSON (chrome://tracing, Perfetto)
+namespace trace {
+extern std::atomic<bool> active;
+void init(const std::filesystem::path &path);
+// only once every other thread that may record has been joined
+void deinit(void);
+void begin(const char *name);
+void end(const char *name);
+void instant(const char *name);
+
+class span_t {
+private:
+  const char *name;
+  void (*leave)(void);
+
+public:
+  span_t(const char *name, void (*leave)(void)) : name(name), leave(leave) {
+    if (active.load(std::memory_order_relaxed)) begin(name);
+  }
+  ~span_t(void) {
+    this->leave();
+    if (active.load(std::memory_order_relaxed)) end(this->name);
+  }
+  span_t(const span_t &)            = delete;
+  span_t &operator=(const span_t &) = delete;
+};
+} // namespace trace
+
+#endif
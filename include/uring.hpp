@@ -0,0 +1,39 @@
+#ifndef URING_HPP
+#define URING_HPP
+
+#pragma once
+
+#ifndef __linux__
+#error "uring.hpp is only available on Linux"
+#endif
+
+extern "C" {
+#include <linux/io_uring.h>
+}
+#include <types.hpp>
+
+// bare io_uring instance, submissions are filled in by the caller
+class uring_t {
+private:
+  i32 fd;
+  u32 queued;
+  void *sq_ring, *cq_ring;
+  u64 sq_ring_size, cq_ring_size, sqes_size;
+  u32 *sq_head, *sq_tail, *sq_mask, *sq_array;
+  u32 *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  u32 sq_entries;
+
+public:
+  uring_t(u32 entries);
+  ~uring_t(void);
+  uring_t(const uring_t &)            = delete;
+  uring_t &operator=(const uring_t &) = delete;
+  bool ok(void) const;
+  struct io_uring_sqe *next(void);
+  i32 submit(u32 wait = 0);
+  bool reap(u64 &data, i32 &res);
+};
+
+#endif
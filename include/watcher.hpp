@@ -7,13 +7,12 @@
 #error "watcher.hpp is only available on Linux"
 #endif
 
-#include <atomic>
 #include <filesystem>
 #include <map>
-#include <mutex>
+#include <memory>
+#include <optional>
 #include <queue>
-#include <semaphore>
-#include <thread>
+#include <set>
 #include <types.hpp>
 
 struct event_t {
@@ -21,26 +20,50 @@ struct event_t {
   u32 mask;
 };
 
+class poller_t;
+
 class watcher_t {
 private:
+  struct watch_t {
+    i32 wd;
+    u32 mask;
+    bool frontier; // first level below the directories that matter, in sparse mode
+  };
   i32 fd;
-  std::atomic<bool> running;
-  std::thread antenna;
+  bool running, sparse;
   std::map<i32, std::filesystem::path> nodes;
+  std::map<std::filesystem::path, watch_t> watches; // reverse of `nodes`
+  std::set<std::filesystem::path> excluded, tops, pinned;
   std::queue<event_t> events;
-  std::mutex events_mutex, nodes_mutex;
-  std::counting_semaphore<0x7fffffff> events_semaphore;
+  std::unique_ptr<poller_t> poller; // stands in for inotify when set
 
-  void depot(void);
+  bool depot(void);
+  bool skipped(const std::filesystem::path &path) const;
+  void set(const std::filesystem::path &path, u32 mask, bool frontier);
+  void drop(const std::filesystem::path &path, bool self);
+  bool shape(const std::filesystem::path &path);
+  void promote(const std::filesystem::path &path);
 
 public:
   watcher_t(void);
   ~watcher_t(void);
   void add(std::filesystem::path path, bool recursive = true);
   void remove(std::filesystem::path path, bool recursive = true);
+  void exclude(std::filesystem::path path);
+  // only directories holding sources or pinned files get full watches, the ones around them cheap ones
+  void sparsify(void);
+  // scans with statx instead of relying on inotify, for filesystems that do not report changes
+  void use_polling(void);
+  // whether inotify sees the changes made on the filesystem of `path`, network and fuse mounts it does not
+  static bool supported(const std::filesystem::path &path);
+  // directories of the files in the dependency graph, they keep full watches in sparse mode
+  void pin(const std::filesystem::path &directory);
+  void unpin(const std::filesystem::path &directory);
   void start(void);
   void stop(void);
-  event_t poll(void);
+  // readable whenever `poll` has something to return
+  i32 handle(void) const;
+  std::optional<event_t> poll(void);
 };
 
-#endif
\ No newline at end of file
+#endif
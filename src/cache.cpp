@@ -0,0 +1,186 @@
+#include <cache.hpp>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+}
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <jot.hpp>
+#include <map>
+#include <optional>
+#include <set>
+#include <sha256.hpp>
+#include <slurp.hpp>
+#include <tuple>
+#include <vector>
+
+typedef std::filesystem::path path_t;
+
+static path_t root_directory;
+static u64 size_limit = 0;
+
+// outputs worth keeping, next to the pdf the files that spare passes on the next build
+static constexpr std::string_view OUTPUTS[] = { ".pdf", ".aux", ".bbl" };
+
+// digests of files by identity, kept across builds so that a key only reads what changed since
+static std::map<path_t, std::pair<input_t, std::array<u8, 32>>> digests;
+
+// timestamps are taken from a coarse clock, a file written again within the same tick keeps its stamp. stamps that
+// recent are not trusted to identify content
+static constexpr u64 RACY_NS = 20'000'000;
+
+static std::optional<input_t> identify(const path_t &path) {
+  struct statx stx;
+  if (statx(AT_FDCWD, path.c_str(), 0, STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME, &stx) == -1)
+    return std::nullopt;
+  auto ns = [](const struct statx_timestamp &ts) { return (u64)ts.tv_sec * 1'000'000'000 + ts.tv_nsec; };
+  return input_t{
+    .path  = path,
+    .dev   = makedev(stx.stx_dev_major, stx.stx_dev_minor),
+    .ino   = stx.stx_ino,
+    .size  = stx.stx_size,
+    .mtime = ns(stx.stx_mtime),
+    .ctime = ns(stx.stx_ctime),
+  };
+}
+static bool racy(const input_t &input) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return std::max(input.mtime, input.ctime) + RACY_NS > (u64)now.tv_sec * 1'000'000'000 + now.tv_nsec;
+}
+
+static void replace(const path_t &from, const path_t &to, std::error_code &ec) {
+  // through a temporary and a rename, viewers may be reading `to`
+  const path_t temporary = to.parent_path() / fmt::format(".{}.tmp", to.filename().string());
+  std::filesystem::copy_file(from, temporary, std::filesystem::copy_options::overwrite_existing, ec);
+  if (!ec) std::filesystem::rename(temporary, to, ec);
+}
+
+// least recently used entries go first, hits refresh the modification time of their directory
+static void evict(void) {
+  std::vector<std::tuple<std::filesystem::file_time_type, path_t, u64>> entries;
+  u64 total = 0;
+  std::error_code ec;
+  for (auto &&entry : std::filesystem::directory_iterator(root_directory, ec)) {
+    if (!entry.is_directory()) continue;
+    u64 size = 0;
+    for (auto &&file : std::filesystem::directory_iterator(entry.path(), ec))
+      if (file.is_regular_file()) size += file.file_size();
+    entries.emplace_back(entry.last_write_time(), entry.path(), size);
+    total += size;
+  }
+  std::sort(entries.begin(), entries.end());
+  for (auto &&[_, path, size] : entries) {
+    if (total <= size_limit) break;
+    jot::debug("cache: evicting `{}`", path.filename().string());
+    std::filesystem::remove_all(path, ec);
+    total -= size;
+  }
+}
+
+namespace cache {
+void init(path_t directory, u64 limit) {
+  std::error_code ec;
+  std::filesystem::create_directories(directory, ec);
+  if (ec) {
+    jot::warn("cache: cannot create `{}`: {}", directory.string(), ec.message());
+    return;
+  }
+  root_directory = std::filesystem::canonical(directory);
+  size_limit     = limit;
+  evict();
+}
+bool enabled(void) { return size_limit != 0; }
+
+state_t key(const path_t &root, const graph_t &deps, std::string_view backend) {
+  std::set<path_t> closure;
+  std::vector<path_t> queue = { root };
+  while (queue.size()) {
+    auto next = queue.back();
+    queue.pop_back();
+    if (!closure.insert(next).second || !deps.contains(next)) continue;
+    for (auto &&[dep, _] : deps.at(next)) queue.push_back(dep);
+  }
+  state_t key;
+  std::vector<path_t> stale;
+  std::vector<input_t> changed;
+  for (auto &&path : closure) {
+    const auto input = identify(path);
+    if (!input.has_value()) continue;
+    key.inputs.push_back(input.value());
+    const auto it = digests.find(path);
+    if (it != digests.end() && it->second.first == input.value() && !racy(input.value())) continue;
+    stale.push_back(path);
+    changed.push_back(input.value());
+  }
+  slurp::load(stale, [&](const path_t &path, char *content, u64 size) {
+    sha256_t file;
+    file.add(content, size);
+    digests[path] = { changed[&path - stale.data()], file.digest() };
+  });
+  // every file is hashed on its own, the order files are loaded in must not matter
+  sha256_t digest;
+  digest.add(backend);
+  digest.add(root.string());
+  for (auto &&input : key.inputs) {
+    // unreadable files are left out, as is the digest of an older state
+    if (!digests.contains(input.path) || digests.at(input.path).first != input) continue;
+    digest.add(input.path.string());
+    digest.add(digests.at(input.path).second.data(), 32);
+  }
+  key.digest = digest.hex();
+  jot::debug("cache: {} of {} inputs read", stale.size(), key.inputs.size());
+  return key;
+}
+
+bool restore(const state_t &key, const path_t &root, const path_t &workdir) {
+  const path_t entry = root_directory / key.digest;
+  std::error_code ec;
+  if (!std::filesystem::is_directory(entry, ec)) return false;
+  for (auto &&ext : OUTPUTS) {
+    const path_t name = path_t(root.stem()).concat(ext);
+    // a leftover of another state, e.g. a .bbl after the bibliography was dropped
+    if (!std::filesystem::exists(entry / name, ec)) {
+      std::filesystem::remove(workdir / name, ec);
+      continue;
+    }
+    replace(entry / name, workdir / name, ec);
+    if (ec) {
+      jot::warn("cache: cannot restore `{}`: {}", name.string(), ec.message());
+      return false;
+    }
+  }
+  std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), ec);
+  return true;
+}
+
+void store(const state_t &key, const path_t &root, const path_t &workdir) {
+  const path_t entry     = root_directory / key.digest;
+  const path_t temporary = root_directory / fmt::format(".{}.tmp", key.digest);
+  std::error_code ec;
+  if (std::filesystem::exists(entry)) return;
+  for (auto &&input : key.inputs) {
+    if (identify(input.path) == input) continue;
+    jot::debug("cache: `{}` changed during the build, not storing", input.path.string());
+    return;
+  }
+  std::filesystem::create_directories(temporary, ec);
+  for (auto &&ext : OUTPUTS) {
+    const path_t name = path_t(root.stem()).concat(ext);
+    if (ec || !std::filesystem::exists(workdir / name)) continue;
+    std::filesystem::copy_file(workdir / name, temporary / name, ec);
+  }
+  // entries appear whole or not at all
+  if (!ec) std::filesystem::rename(temporary, entry, ec);
+  if (ec) {
+    jot::warn("cache: cannot store `{}`: {}", root.string(), ec.message());
+    std::filesystem::remove_all(temporary, ec);
+    return;
+  }
+  evict();
+}
+} // namespace cache
@@ -0,0 +1,226 @@
+#include <cgroup.hpp>
+
+extern "C" {
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+}
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <jot.hpp>
+#include <map>
+#include <optional>
+#include <options.hpp>
+#include <reactor.hpp>
+#include <sstream>
+#include <string>
+
+typedef std::filesystem::path path_t;
+
+static path_t jobs_directory;
+static bool available = false;
+static u64 counter    = 0;
+static std::map<i32, path_t> leaves;
+// killed leaves whose processes are still exiting, by the inotify watch on their cgroup.events
+static i32 notifier = -1;
+static std::map<i32, path_t> draining;
+
+static constexpr i32 DRAIN_TIMEOUT_MS = 1000;
+
+static bool write(const path_t &path, std::string_view value) {
+  std::ofstream output(path);
+  output << value;
+  output.flush();
+  if (!output) {
+    jot::debug("cgroup: cannot write `{}` to `{}`", value, path.string());
+    return false;
+  }
+  return true;
+}
+static std::string read(const path_t &path) {
+  std::ifstream input(path);
+  std::stringstream content;
+  content << input.rdbuf();
+  return content.str();
+}
+
+static bool populated(const path_t &leaf) {
+  return read(leaf / "cgroup.events").find("populated 1") != std::string::npos;
+}
+// false while processes are still in the leaf, cgroup.kill only starts killing them
+static bool drop(const path_t &leaf) {
+  std::error_code ec;
+  std::filesystem::remove(leaf, ec);
+  if (ec == std::errc::device_or_resource_busy) return false;
+  if (ec) jot::warn("cgroup: cannot remove `{}`: {}", leaf.string(), ec.message());
+  return true;
+}
+static void drain(u32) {
+  alignas(struct inotify_event) byte buffer[0x1000];
+  const i64 length = ::read(notifier, buffer, sizeof(buffer));
+  for (i64 offset = 0; offset < length;) {
+    const struct inotify_event *event = (const struct inotify_event *)(buffer + offset);
+    offset += sizeof(*event) + event->len;
+    const auto it = draining.find(event->wd);
+    if (it == draining.end() || populated(it->second)) continue;
+    inotify_rm_watch(notifier, event->wd);
+    if (!drop(it->second)) jot::warn("cgroup: `{}` still busy once empty", it->second.string());
+    draining.erase(it);
+  }
+}
+// cgroup.events is modified when the last process leaves
+static void defer(const path_t &leaf) {
+  if (notifier == -1) {
+    notifier = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notifier == -1) {
+      jot::warn("cgroup: cannot wait for `{}` to empty, it is left behind", leaf.string());
+      return;
+    }
+    reactor::watch(notifier, drain);
+  }
+  const i32 wd = inotify_add_watch(notifier, (leaf / "cgroup.events").c_str(), IN_MODIFY);
+  if (wd == -1) {
+    jot::warn("cgroup: cannot watch `{}`, it is left behind", leaf.string());
+    return;
+  }
+  draining[wd] = leaf;
+  // emptied before the watch was in place
+  if (populated(leaf)) return;
+  inotify_rm_watch(notifier, wd);
+  draining.erase(wd);
+  if (!drop(leaf)) jot::warn("cgroup: `{}` still busy once empty", leaf.string());
+}
+
+// where the unified hierarchy is mounted, /sys/fs/cgroup on pure v2 systems, somewhere below it on hybrid ones
+static std::optional<path_t> mountpoint(void) {
+  std::ifstream input("/proc/self/mountinfo");
+  std::string line;
+  while (std::getline(input, line)) {
+    if (line.find(" - cgroup2 ") == std::string::npos) continue;
+    std::istringstream fields(line);
+    std::string id, parent, device, root, mount;
+    fields >> id >> parent >> device >> root >> mount;
+    return mount;
+  }
+  return std::nullopt;
+}
+
+namespace cgroup {
+bool init(void) {
+  const auto mount = mountpoint();
+  if (!mount.has_value()) {
+    jot::warn("cgroup: no cgroup v2 hierarchy mounted");
+    return false;
+  }
+  std::string own;
+  {
+    std::ifstream input("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(input, line))
+      if (line.starts_with("0::")) own = line.substr(3);
+  }
+  const path_t base = mount.value() / path_t(own).relative_path();
+  // no internal processes: controllers are only handed down once we left our own cgroup for a leaf
+  std::error_code ec;
+  std::filesystem::create_directories(base / "watcher", ec);
+  if (ec || !write(base / "watcher" / "cgroup.procs", std::to_string(getpid()))) {
+    jot::warn("cgroup: `{}` is not delegated to us", base.string());
+    return false;
+  }
+  std::string controllers;
+  {
+    std::istringstream available(read(base / "cgroup.controllers"));
+    std::string name;
+    while (available >> name)
+      if (name == "cpu" || name == "memory" || name == "io") controllers += fmt::format("+{} ", name);
+  }
+  write(base / "cgroup.subtree_control", controllers);
+  jobs_directory = base / "jobs";
+  std::filesystem::create_directories(jobs_directory, ec);
+  if (ec) {
+    jot::warn("cgroup: cannot create `{}`: {}", jobs_directory.string(), ec.message());
+    return false;
+  }
+  write(jobs_directory / "cgroup.subtree_control", controllers);
+  // a controller missing from the delegation means the limit silently would not hold
+  const auto &options = options::get();
+  bool applied        = true;
+  if (options.cpu_max.has_value()) applied &= write(jobs_directory / "cpu.max", options.cpu_max.value());
+  if (options.cpu_weight) applied &= write(jobs_directory / "cpu.weight", std::to_string(options.cpu_weight));
+  if (options.memory_high) applied &= write(jobs_directory / "memory.high", std::to_string(options.memory_high));
+  if (options.io_weight) applied &= write(jobs_directory / "io.weight", fmt::format("default {}", options.io_weight));
+  if (!applied) {
+    jot::warn("cgroup: controllers missing in `{}`", base.string());
+    return false;
+  }
+  jot::debug("cgroup: jobs run in `{}`", jobs_directory.string());
+  return available = true;
+}
+bool enabled(void) { return available; }
+
+i32 enter(void) {
+  if (!available) return -1;
+  const path_t leaf = jobs_directory / std::to_string(counter++);
+  std::error_code ec;
+  std::filesystem::create_directory(leaf, ec);
+  if (ec) {
+    jot::warn("cgroup: cannot create `{}`: {}", leaf.string(), ec.message());
+    return -1;
+  }
+  i32 fd = open(leaf.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    std::filesystem::remove(leaf, ec);
+    return -1;
+  }
+  leaves[fd] = leaf;
+  return fd;
+}
+
+void kill(i32 fd) {
+  if (!leaves.contains(fd)) return;
+  write(leaves.at(fd) / "cgroup.kill", "1");
+}
+
+usage_t leave(i32 fd) {
+  usage_t usage = { .memory = 0, .cpu = 0 };
+  if (!leaves.contains(fd)) return usage;
+  const path_t leaf = leaves.at(fd);
+  {
+    std::istringstream peak(read(leaf / "memory.peak"));
+    peak >> usage.memory;
+  }
+  {
+    std::istringstream stat(read(leaf / "cpu.stat"));
+    std::string key;
+    u64 value;
+    while (stat >> key >> value)
+      if (key == "usage_usec") usage.cpu = value;
+  }
+  // compilers may leave daemons behind, the leaf only goes away once they are gone
+  kill(fd);
+  close(fd);
+  leaves.erase(fd);
+  if (!drop(leaf)) defer(leaf);
+  return usage;
+}
+
+void deinit(void) {
+  // the reactor is no longer running, the leaves of the jobs cancelled on exit are waited for here
+  using namespace std::chrono;
+  const auto deadline = steady_clock::now() + milliseconds(DRAIN_TIMEOUT_MS);
+  while (draining.size()) {
+    const i64 left    = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+    struct pollfd pfd = { .fd = notifier, .events = POLLIN, .revents = 0 };
+    if (left <= 0 || poll(&pfd, 1, left) <= 0) break;
+    drain(0);
+  }
+  for (auto &&[_, leaf] : draining) jot::warn("cgroup: `{}` did not empty in time, it is left behind", leaf.string());
+  draining.clear();
+  if (notifier == -1) return;
+  reactor::unwatch(notifier);
+  close(notifier);
+  notifier = -1;
+}
+} // namespace cgroup
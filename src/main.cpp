@@ -1,4 +1,6 @@
-#include <array>
+#include <cache.hpp>
+#include <cgroup.hpp>
+#include <chrono>
 #include <compare>
 #include <csignal>
 #include <filesystem>
@@ -6,106 +8,252 @@
 #include <fmt/format.h>
 #include <jot.hpp>
 #include <map>
+#include <meta.hpp>
+#include <options.hpp>
+#include <reactor.hpp>
+#include <replay.hpp>
+#include <set>
 #include <shrdmm.hpp>
+#include <stats.hpp>
 #include <string>
 #include <tex.hpp>
+#include <trace.hpp>
 #include <types.hpp>
 #include <watcher.hpp>
 extern "C" {
 #include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 }
 
 typedef std::filesystem::path path_t;
-typedef std::array<u64, 22> statistic_t;
 
 void atstart(void);
 void atend(void);
-void interrupt(int);
+void interrupt(u32);
 
 void welcome(void);
-statistic_t &updatestat(path_t path, u32 mask);
+void dispatch(const event_t &event);
+void flush(u32);
+void schedule(const path_t &path);
+void reshape(void);
+void surveyed(void);
 std::string maskstr(u32 mask);
 
-static std::map<path_t, statistic_t> statistics;
 static watcher_t watcher;
+static graph_t deps, roots;
+// changed files wait here until the debounce timer fires, so that bursts of saves end up in one build
+static std::set<path_t> pending;
+// sources held back until the survey tells whether something includes them
+static std::set<path_t> orphans;
+static std::chrono::steady_clock::time_point since;
+static i32 debounce = -1, signals = -1;
+
+static constexpr i64 DEBOUNCE_NS = 50'000'000;
 
 #define MATCH(code, mask) (((code) & (mask)) == (mask))
 
 int main(int argc, char *argv[]) {
   { atstart(); }
-  path_t path = argc > 1 ? argv[1] : ".";
-  path        = std::filesystem::canonical(path);
-  path        = std::filesystem::absolute(path);
+  options::parse(argc, argv);
+  const path_t &path = options::get().root;
   jot::info("watching `{}`", path.string());
+  if (options::get().outdir.has_value()) {
+    jot::info("building into `{}`", options::get().outdir->string());
+    watcher.exclude(options::get().outdir.value());
+  }
+  if (options::get().trace.has_value()) trace::init(options::get().trace.value());
+  stats::init(options::get().stats);
+  if (options::get().record.has_value()) replay::record(options::get().record.value(), path);
+  if (options::get().replay.has_value()) {
+    replay::play(options::get().replay.value(), path, options::get().asap,
+                 [] { return pending.empty() && tex::ready() && !tex::busy(); });
+  }
+  if (options::get().cache) cache::init(options::get().cachedir, options::get().cache);
+  if (options::get().isolate && !replay::playing() && !cgroup::init())
+    jot::warn("no cgroup available, compile jobs only get scheduling classes");
+  const backend_t backend = options::get().backend;
+  if (backend == backend_t::poll || (backend == backend_t::automatic && !watcher_t::supported(path))) {
+    jot::info("polling for changes, inotify does not see them here");
+    watcher.use_polling();
+  }
+  if (options::get().sparse) watcher.sparsify();
   watcher.add(path);
   watcher.start();
-  graph_t deps, roots;
-  tex::analyze(path, deps, roots);
-  while (true) {
-    auto event = watcher.poll();
-    jot::debug("{} {}", event.path.string(), maskstr(event.mask));
-    if (MATCH(event.mask, IN_CREATE | IN_ISDIR)) {
-      watcher.add(event.path);
-      continue;
-    }
-    if (MATCH(event.mask, IN_DELETE | IN_ISDIR)) {
-      watcher.remove(event.path);
-      continue;
-    }
-    if (MATCH(event.mask, IN_DELETE_SELF)) {
-      watcher.remove(event.path);
-      continue;
-    }
-    if (event.path.extension().string() != ".tex") continue;
-    const auto &stat = updatestat(event.path, event.mask);
-    if (MATCH(event.mask, IN_CLOSE_WRITE)) {
-      jot::info("`{}` modified [x{}]", event.path.string(), stat[2]);
-      tex::analyze(event.path, deps, roots);
-      tex::build(event.path, deps, roots);
-    }
-  }
+  tex::survey(path, deps, roots, surveyed);
+  reactor::watch(watcher.handle(), [](u32) {
+    while (auto event = watcher.poll()) dispatch(event.value());
+  });
+  reactor::watch(debounce, flush);
+  reactor::watch(signals, interrupt);
+  reactor::run();
   { atend(); }
   return 0;
 }
 
-static constexpr u32 FLAGS[] = {
-  IN_ACCESS,    IN_ATTRIB,      IN_CLOSE_WRITE, IN_CLOSE_NOWRITE, IN_CREATE,   IN_DELETE,  IN_DELETE_SELF, IN_MODIFY,
-  IN_MOVE_SELF, IN_MOVED_FROM,  IN_MOVED_TO,    IN_OPEN,          IN_IGNORED,  IN_ISDIR,   IN_Q_OVERFLOW,  IN_UNMOUNT,
-  IN_ONLYDIR,   IN_DONT_FOLLOW, IN_EXCL_UNLINK, IN_MASK_CREATE,   IN_MASK_ADD, IN_ONESHOT,
-};
-static constexpr std::string_view FLAGSSTR[] = {
-  "ACCESS",    "ATTRIB",      "CLOSE_WRITE", "CLOSE_NOWRITE", "CREATE",   "DELETE",  "DELETE_SELF", "MODIFY",
-  "MOVE_SELF", "MOVED_FROM",  "MOVED_TO",    "OPEN",          "IGNORED",  "ISDIR",   "Q_OVERFLOW",  "UNMOUNT",
-  "ONLYDIR",   "DONT_FOLLOW", "EXCL_UNLINK", "MASK_CREATE",   "MASK_ADD", "ONESHOT",
-};
-static_assert(sizeof(FLAGS) / sizeof(*FLAGS) == sizeof(FLAGSSTR) / sizeof(*FLAGSSTR));
-static constexpr u64 NFLAGS = sizeof(FLAGS) / sizeof(*FLAGS);
+void dispatch(const event_t &event) {
+#ifdef DEBUG
+  jot::debug("{} {}", event.path.string(), maskstr(event.mask));
+#endif
+  if (event.mask & IN_Q_OVERFLOW) {
+    meta::clear();
+  } else {
+    meta::invalidate(event.path);
+  }
+  if (MATCH(event.mask, IN_CREATE | IN_ISDIR) || MATCH(event.mask, IN_MOVED_TO | IN_ISDIR)) {
+    watcher.add(event.path);
+    return;
+  }
+  if (MATCH(event.mask, IN_DELETE | IN_ISDIR)) {
+    watcher.remove(event.path);
+    return;
+  }
+  if (MATCH(event.mask, IN_DELETE_SELF)) {
+    watcher.remove(event.path);
+    return;
+  }
+  // besides sources, anything the graph points at (bibliographies, styles, figures, listings) triggers a build
+  const bool source  = event.path.extension().string() == ".tex";
+  const bool tracked = roots.contains(event.path) && roots.at(event.path).size();
+  if (!source && !tracked) {
+    // while the graph is still being surveyed, the file may turn out to be pulled in by a source not analyzed yet
+    const bool written = MATCH(event.mask, IN_CLOSE_WRITE) || MATCH(event.mask, IN_MOVED_TO);
+    if (written && !tex::ready() && tex::trackable(event.path)) schedule(event.path);
+    return;
+  }
+  const record_t *stat = stats::update(event.path, event.mask);
+  // editors saving atomically rename a temporary file over the original
+  if (MATCH(event.mask, IN_CLOSE_WRITE) || MATCH(event.mask, IN_MOVED_TO)) {
+    const u64 writes = stat ? stat->count[slot_of(IN_CLOSE_WRITE)].load(std::memory_order_relaxed) : 0;
+    jot::info("`{}` modified [x{}]", event.path.string(), writes);
+    schedule(event.path);
+  }
+}
+
+void schedule(const path_t &path) {
+  if (pending.empty()) since = std::chrono::steady_clock::now();
+  pending.insert(path);
+  const struct itimerspec quiet = { .it_interval = {}, .it_value = { .tv_sec = 0, .tv_nsec = DEBOUNCE_NS } };
+  if (timerfd_settime(debounce, 0, &quiet, nullptr) == -1) jot::warn("cannot arm debounce timer");
+}
+
+void flush(u32) {
+  u64 expirations;
+  if (read(debounce, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+  auto elapsed = [](std::chrono::steady_clock::time_point from) {
+    return (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - from).count();
+  };
+  replay::sample("debounce", elapsed(since));
+  const auto start = std::chrono::steady_clock::now();
+  std::set<path_t> changed;
+  std::swap(changed, pending);
+  for (auto &&path : changed)
+    if (path.extension() == ".tex") tex::analyze(path, deps, roots);
+  if (!tex::ready())
+    for (auto &&path : changed) tex::analyze_ancestors(path, options::get().root, deps, roots);
+  // inputs scheduled on suspicion, or untracked meanwhile, would be compiled as documents of their own
+  std::erase_if(changed, [](const path_t &path) {
+    return path.extension() != ".tex" && !(roots.contains(path) && roots.at(path).size());
+  });
+  // a fragment whose includer is not known yet would be compiled as a document of its own
+  if (!tex::ready())
+    std::erase_if(changed, [](const path_t &path) {
+      if ((roots.contains(path) && roots.at(path).size()) || tex::standalone(path)) return false;
+      orphans.insert(path);
+      return true;
+    });
+  reshape();
+  replay::sample("analyze", elapsed(start));
+  const auto analyzed = std::chrono::steady_clock::now();
+  tex::build(changed, deps, roots);
+  replay::sample("plan", elapsed(analyzed));
+}
+
+// the graph is complete: held back sources are built through whatever includes them now
+void surveyed(void) {
+  reshape();
+  for (auto &&path : orphans) schedule(path);
+  orphans.clear();
+}
+
+// sparse watches follow the graph: directories of whatever the sources pull in stay fully watched. only the inputs
+// whose users changed are looked at, `used` counts the inputs pulled in per directory
+void reshape(void) {
+  static std::set<path_t> inputs;
+  static std::map<path_t, u64> used;
+  const std::set<path_t> touched = tex::touched();
+  if (!options::get().sparse) return;
+  for (auto &&file : touched) {
+    const bool input = roots.contains(file) && roots.at(file).size();
+    if (input == inputs.contains(file)) continue;
+    const path_t directory = file.parent_path();
+    if (input) {
+      inputs.insert(file);
+      if (used[directory]++ == 0) watcher.pin(directory);
+    } else {
+      inputs.erase(file);
+      if (--used[directory] == 0) {
+        used.erase(directory);
+        watcher.unpin(directory);
+      }
+    }
+  }
+}
 
 void atstart(void) {
   std::setbuf(stdout, nullptr);
   std::setbuf(stderr, nullptr);
   shrdmm::init();
   jot::init();
-  std::signal(SIGINT, interrupt);
+  // signals are read from the event loop instead of interrupting it
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  if (sigprocmask(SIG_BLOCK, &mask, nullptr) == -1) die("cannot block signals");
+  signals = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signals == -1) die("cannot create signalfd");
+  // a writer breaking the read lease the watcher takes to check a source raises SIGIO, which would terminate us.
+  // it stays pending instead, compile jobs start with an empty mask
+  sigset_t leases;
+  sigemptyset(&leases);
+  sigaddset(&leases, SIGIO);
+  if (sigprocmask(SIG_BLOCK, &leases, nullptr) == -1) die("cannot block signals");
+  debounce = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (debounce == -1) die("cannot create debounce timer");
   welcome();
 }
 void atend(void) {
+  for (auto *record : stats::records()) {
+    jot::debug("{}:", record->name);
+    for (u64 i = 0; i < NFLAGS; i++) {
+      const u64 count = record->count[i].load(std::memory_order_relaxed);
+      if (count) jot::debug("  {}: {}", FLAGSSTR[i], count);
+    }
+    if (const u64 writes = record->count[slot_of(IN_CLOSE_WRITE)].load(std::memory_order_relaxed)) {
+      jot::info("`{}` has been modified {} times", record->name, writes);
+    }
+  }
+  stats::deinit();
+  replay::finish();
+  tex::cancel();
+  cgroup::deinit();
+  // every thread that records has been joined by now
+  trace::deinit();
   watcher.stop();
+  close(debounce);
+  close(signals);
   jot::deinit();
   shrdmm::deinit();
 }
 
-void interrupt(int) {
-  fmt::print(stderr, "\n");
-  jot::info("interrupted by user");
-  for (auto &&[path, stat] : statistics) {
-    jot::debug("{}:", path.string());
-    for (u64 i = 0; i < NFLAGS; i++)
-      if (stat[i]) jot::debug("  {}: {}", FLAGSSTR[i], stat[i]);
-    if (stat[2]) { jot::info("`{}` has been modified {} times", path.string(), stat[2]); }
-  }
-  atend();
-  std::exit(1);
+void interrupt(u32) {
+  struct signalfd_siginfo info;
+  if (read(signals, &info, sizeof(info)) != sizeof(info)) return;
+  if (info.ssi_signo == SIGINT) fmt::print(stderr, "\n");
+  jot::info("interrupted by {}", info.ssi_signo == SIGINT ? "user" : "signal");
+  reactor::stop();
 }
 
 void welcome(void) {
@@ -117,22 +265,15 @@ void welcome(void) {
   fmt::print(stderr, "{}{} v{}\n", watch, tex, version);
 }
 
-statistic_t &updatestat(path_t path, u32 mask) {
-  if (!statistics.contains(path)) statistics.insert({ path, statistic_t() });
-  auto &stat = statistics.at(path);
-  for (u32 i = 0; i < NFLAGS; i++)
-    if (MATCH(mask, FLAGS[i])) stat[i]++;
-  return stat;
-}
-
 std::string maskstr(u32 mask) {
   static constexpr std::string_view SEP = " | ";
   std::string str;
-  for (u32 i = 0; i < NFLAGS; i++)
-    if (MATCH(mask, FLAGS[i])) {
-      str += FLAGSSTR[i];
-      str += SEP;
-    }
+  for (; mask; mask &= mask - 1) {
+    const u8 slot = SLOTS[__builtin_ctz(mask)];
+    if (slot == NFLAGS) continue;
+    str += FLAGSSTR[slot];
+    str += SEP;
+  }
   if (!str.empty()) str.erase(str.size() - SEP.size());
   return str;
 }
\ No newline at end of file
@@ -0,0 +1,152 @@
+#include <meta.hpp>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/stat.h>
+}
+#include <deque>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+typedef std::filesystem::path path_t;
+using meta::entry_t, meta::kind_t;
+
+static constexpr u32 NONE = ~0u;
+
+struct node_t {
+  u32 canonical; // node of `entry.canonical` once filled
+  std::vector<u32> children;
+  std::vector<u32> aliases; // nodes whose canonical path this one is
+  bool valid;
+  entry_t entry;
+};
+
+// lookups share the lock, interning and invalidation take it exclusively
+static std::shared_mutex lock;
+static std::deque<std::string> names; // backs the keys of `ids`, a deque never moves them
+static std::unordered_map<std::string_view, u32> ids;
+static std::vector<node_t> nodes;
+// bumped by every invalidation, a lookup that raced with one does not store what it found
+static u64 generation = 0;
+static std::map<path_t, bool> watched; // directory, fully watched
+
+// whether every change to `path` comes back through invalidate(): its directory and the ones leading there up to
+// the top of the watched tree have full watches, so renames of any of them are seen too. a `..` passing through a
+// symlink is caught by the check on the canonical path
+static bool trusted(const path_t &path) {
+  if (!path.is_absolute()) return false;
+  path_t directory = path.lexically_normal().parent_path();
+  auto it          = watched.find(directory);
+  if (it == watched.end()) return false;
+  // the top is the first directory whose parent has no watch
+  while (it != watched.end()) {
+    if (!it->second) return false;
+    if (directory == directory.parent_path()) break;
+    directory = directory.parent_path();
+    it        = watched.find(directory);
+  }
+  return true;
+}
+
+static u32 find(const path_t &path) {
+  const auto it = ids.find(path.native());
+  return it == ids.end() ? NONE : it->second;
+}
+// the parents are interned along, invalidating a directory walks down from there
+static u32 intern(const path_t &path) {
+  if (const u32 id = find(path); id != NONE) return id;
+  const path_t parent = path.parent_path();
+  const u32 up        = parent.empty() || parent == path ? NONE : intern(parent);
+  const u32 id        = nodes.size();
+  names.push_back(path.native());
+  ids.emplace(names.back(), id);
+  nodes.push_back(node_t{ .canonical = NONE, .children = {}, .aliases = {}, .valid = false, .entry = {} });
+  if (up != NONE) nodes[up].children.push_back(id);
+  return id;
+}
+
+// drops the entries of `id` and of everything below it, along with their aliases
+static void forget(u32 id) {
+  std::vector<u32> stack{ id };
+  while (stack.size()) {
+    node_t &node = nodes[stack.back()];
+    stack.pop_back();
+    node.valid = false;
+    for (auto &&alias : node.aliases) nodes[alias].valid = false;
+    stack.insert(stack.end(), node.children.begin(), node.children.end());
+  }
+}
+
+// a statx and a realpath, what the cache saves. only what the watched events keep true, contents are not cached
+static entry_t probe(const path_t &path) {
+  struct statx stx;
+  std::error_code ec;
+  entry_t entry{ .kind = kind_t::missing, .canonical = {} };
+  if (statx(AT_FDCWD, path.c_str(), 0, STATX_TYPE, &stx) == -1) {
+    entry.canonical = std::filesystem::weakly_canonical(path, ec);
+  } else {
+    entry.kind = S_ISREG(stx.stx_mode) ? kind_t::regular : S_ISDIR(stx.stx_mode) ? kind_t::directory : kind_t::other;
+    entry.canonical = std::filesystem::canonical(path, ec);
+  }
+  if (ec || entry.canonical.empty()) entry.canonical = path; // changed meanwhile
+  return entry;
+}
+
+namespace meta {
+void watch(const path_t &directory, bool full) {
+  std::unique_lock guard(lock);
+  auto [it, fresh] = watched.try_emplace(directory, full);
+  if (fresh || it->second == full) return;
+  it->second = full;
+  // events missed until now
+  generation++;
+  if (const u32 id = find(directory); id != NONE) forget(id);
+}
+void unwatch(const path_t &directory) {
+  std::unique_lock guard(lock);
+  generation++;
+  watched.erase(directory);
+  if (const u32 id = find(directory); id != NONE) forget(id);
+}
+
+entry_t lookup(const path_t &path) {
+  bool cacheable;
+  u64 seen;
+  {
+    std::shared_lock guard(lock);
+    // only trusted paths get entries
+    const u32 id = find(path);
+    if (id != NONE && nodes[id].valid) return nodes[id].entry;
+    cacheable = trusted(path);
+    seen      = generation;
+  }
+  entry_t entry = probe(path);
+  if (!cacheable) return entry;
+  std::unique_lock guard(lock);
+  // a symlink leading out of the watched tree would go stale unnoticed
+  if (generation != seen || !trusted(entry.canonical)) return entry;
+  const u32 id = intern(path), target = intern(entry.canonical);
+  node_t &node = nodes[id];
+  if (target != id && node.canonical != target) nodes[target].aliases.push_back(id);
+  node.canonical = target;
+  node.entry     = entry;
+  node.valid     = true;
+  return entry;
+}
+
+void invalidate(const path_t &path) {
+  std::unique_lock guard(lock);
+  generation++;
+  if (const u32 id = find(path); id != NONE) forget(id);
+}
+void clear(void) {
+  std::unique_lock guard(lock);
+  generation++;
+  for (auto &&node : nodes) node.valid = false;
+}
+} // namespace meta
@@ -0,0 +1,149 @@
+#include <options.hpp>
+
+extern "C" {
+#include <getopt.h>
+}
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <jot.hpp>
+
+static options_t current;
+
+enum : i32 { CPU_MAX = 0x100, CPU_WEIGHT, MEMORY_HIGH, IO_WEIGHT, STATS, TRACE, RECORD, REPLAY, ASAP, SPARSE, BACKEND };
+
+// decimal, optionally with a K/M/G suffix; signs, overflow and trailing garbage are rejected
+static u64 number(const char *str, const char *what, bool suffixed = true) {
+  const char *last = str + std::strlen(str);
+  u64 value;
+  auto [end, err] = std::from_chars(str, last, value);
+  if (err != std::errc() || end == str) die("invalid {} `{}`", what, str);
+  u32 shift = 0;
+  if (suffixed && end < last) {
+    switch (*end) {
+    case 'G': shift += 10; [[fallthrough]];
+    case 'M': shift += 10; [[fallthrough]];
+    case 'K': shift += 10; end++;
+    }
+  }
+  if (end != last || (shift && value > (~0ull >> shift))) die("invalid {} `{}`", what, str);
+  return value << shift;
+}
+
+static void usage(const char *name) {
+  fmt::print(stderr, "usage: {} [options] [directory]\n", name);
+  fmt::print(stderr, "  -o, --outdir DIR   write build artifacts to DIR (e.g. on tmpfs), copy back only the pdf\n");
+  fmt::print(stderr, "  -p, --preview      compile only the edited chapters first, then the whole document\n");
+  fmt::print(stderr, "  -c, --cache MIB    reuse outputs of already built states, keeping at most MIB mebibytes\n");
+  fmt::print(stderr, "  --cpu-max Q[/P]    cap compile jobs to Q microseconds of cpu every P (cgroup cpu.max)\n");
+  fmt::print(stderr, "  --cpu-weight N     cpu weight of compile jobs, 1-10000 (cgroup cpu.weight)\n");
+  fmt::print(stderr, "  --memory-high B    throttle compile jobs above B bytes, K/M/G suffixes allowed\n");
+  fmt::print(stderr, "  --io-weight N      io weight of compile jobs, 1-10000 (cgroup io.weight)\n");
+  fmt::print(stderr, "  --stats FILE       write per file event counters to FILE every few seconds\n");
+  fmt::print(stderr, "  --trace FILE       record a chrome trace of the run, written to FILE on exit\n");
+  fmt::print(stderr, "  --record FILE      dump the inotify events seen to FILE\n");
+  fmt::print(stderr, "  --replay FILE      feed the events of FILE through the pipeline, stubbing the compiler\n");
+  fmt::print(stderr, "  --asap             replay as fast as possible instead of at the recorded pace\n");
+  fmt::print(stderr, "  --sparse           fully watch only the directories holding sources or their inputs\n");
+  fmt::print(stderr, "  --backend NAME     auto, inotify or poll (stat polling, for NFS, SSHFS and the like)\n");
+  fmt::print(stderr, "  -h, --help         show this message\n");
+}
+
+namespace options {
+void parse(int argc, char *argv[]) {
+  static const struct option LONGOPTS[] = {
+    { "outdir", required_argument, nullptr, 'o' },
+    { "preview", no_argument, nullptr, 'p' },
+    { "cache", required_argument, nullptr, 'c' },
+    { "cpu-max", required_argument, nullptr, CPU_MAX },
+    { "cpu-weight", required_argument, nullptr, CPU_WEIGHT },
+    { "memory-high", required_argument, nullptr, MEMORY_HIGH },
+    { "io-weight", required_argument, nullptr, IO_WEIGHT },
+    { "stats", required_argument, nullptr, STATS },
+    { "trace", required_argument, nullptr, TRACE },
+    { "record", required_argument, nullptr, RECORD },
+    { "replay", required_argument, nullptr, REPLAY },
+    { "asap", no_argument, nullptr, ASAP },
+    { "sparse", no_argument, nullptr, SPARSE },
+    { "backend", required_argument, nullptr, BACKEND },
+    { "help", no_argument, nullptr, 'h' },
+    { nullptr, 0, nullptr, 0 },
+  };
+  i32 opt;
+  while ((opt = getopt_long(argc, argv, "o:pc:h", LONGOPTS, nullptr)) != -1) {
+    switch (opt) {
+    case 'o': current.outdir = optarg; break;
+    case 'p': current.preview = true; break;
+    case 'c': {
+      const u64 mib = number(optarg, "cache size", false);
+      if (mib == 0 || mib > (~0ull >> 20)) die("invalid cache size `{}`", optarg);
+      current.cache = mib << 20;
+      break;
+    }
+    case CPU_MAX:
+      current.cpu_max = optarg;
+      std::replace(current.cpu_max->begin(), current.cpu_max->end(), '/', ' ');
+      current.isolate = true;
+      break;
+    case CPU_WEIGHT:
+      current.cpu_weight = std::clamp<u64>(number(optarg, "cpu weight"), 1, 10000);
+      current.isolate    = true;
+      break;
+    case MEMORY_HIGH:
+      current.memory_high = number(optarg, "memory limit");
+      current.isolate     = true;
+      break;
+    case IO_WEIGHT:
+      current.io_weight = std::clamp<u64>(number(optarg, "io weight"), 1, 10000);
+      current.isolate   = true;
+      break;
+    case STATS: current.stats = std::filesystem::absolute(optarg); break;
+    case TRACE: current.trace = std::filesystem::absolute(optarg); break;
+    case RECORD: current.record = std::filesystem::absolute(optarg); break;
+    case REPLAY: current.replay = std::filesystem::absolute(optarg); break;
+    case ASAP: current.asap = true; break;
+    case SPARSE: current.sparse = true; break;
+    case BACKEND:
+      if (!std::strcmp(optarg, "auto")) {
+        current.backend = backend_t::automatic;
+      } else if (!std::strcmp(optarg, "inotify")) {
+        current.backend = backend_t::inotify;
+      } else if (!std::strcmp(optarg, "poll")) {
+        current.backend = backend_t::poll;
+      } else {
+        die("invalid backend `{}`", optarg);
+      }
+      break;
+    case 'h': usage(argv[0]); std::exit(0);
+    default: usage(argv[0]); std::exit(1);
+    }
+  }
+  if (current.record.has_value() && current.replay.has_value()) die("cannot record and replay at once");
+  if (optind + 1 < argc) {
+    usage(argv[0]);
+    std::exit(1);
+  }
+  std::error_code ec;
+  const std::filesystem::path root = optind < argc ? argv[optind] : ".";
+  current.root                     = std::filesystem::canonical(root, ec);
+  if (ec) die("cannot resolve `{}`: {}", root.string(), ec.message());
+  current.root = std::filesystem::absolute(current.root);
+  if (current.outdir.has_value()) {
+    std::filesystem::create_directories(current.outdir.value(), ec);
+    if (ec) die("cannot create output directory `{}`: {}", current.outdir->string(), ec.message());
+    current.outdir = std::filesystem::canonical(current.outdir.value());
+    // excluding the output directory from the watches would take the whole tree along
+    const auto &outdir = current.outdir.value();
+    auto [end, _]      = std::mismatch(outdir.begin(), outdir.end(), current.root.begin(), current.root.end());
+    if (end == outdir.end()) die("output directory must not be the watched directory nor contain it");
+  }
+  if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+    current.cachedir = std::filesystem::path(xdg) / "watchtex";
+  } else if (const char *home = std::getenv("HOME"); home && *home) {
+    current.cachedir = std::filesystem::path(home) / ".cache" / "watchtex";
+  } else {
+    current.cachedir = std::filesystem::temp_directory_path() / "watchtex";
+  }
+}
+const options_t &get(void) { return current; }
+} // namespace options
@@ -0,0 +1,215 @@
+#include <poller.hpp>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+}
+#include <algorithm>
+#include <cstring>
+#include <jot.hpp>
+#include <meta.hpp>
+
+typedef std::filesystem::path path_t;
+
+static constexpr u32 RING_ENTRIES = 128;
+static constexpr u64 NS           = 1'000'000'000;
+static constexpr u64 MIN_INTERVAL = NS / 4;
+static constexpr u64 MAX_INTERVAL = NS * 4;
+static constexpr u32 STATX_MASK   = STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME;
+
+static u64 now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NS + ts.tv_nsec;
+}
+// microseconds of cpu spent by this thread
+static u64 cputime(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1'000'000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+static stamp_t stamp_of(const struct statx &stx) {
+  const u64 mtime = stx.stx_mtime.tv_sec * NS + stx.stx_mtime.tv_nsec;
+  return stamp_t{ .ino = stx.stx_ino, .size = stx.stx_size, .mtime = mtime };
+}
+
+poller_t::poller_t(void) : timer(-1), ring(RING_ENTRIES), scans(0), cpu(0) {
+  this->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (this->timer == -1) die("poller_t: cannot create timer");
+}
+poller_t::~poller_t(void) { close(this->timer); }
+
+// missing stamps for paths that are gone; batches go through io_uring, single statx calls are the fallback
+void poller_t::stat(const std::vector<path_t> &paths, std::vector<std::optional<stamp_t>> &stamps) {
+  stamps.assign(paths.size(), std::nullopt);
+  std::vector<struct statx> buffers(paths.size());
+  std::vector<bool> retry(paths.size(), !this->ring.ok());
+  for (u64 first = 0; this->ring.ok() && first < paths.size(); first += RING_ENTRIES) {
+    const u64 last = std::min<u64>(first + RING_ENTRIES, paths.size());
+    u64 pending    = 0;
+    for (u64 i = first; i < last; i++) {
+      auto *sqe = this->ring.next();
+      // entries the kernel has not taken yet hold the ring, handing them over frees it
+      if (!sqe) {
+        if (this->ring.submit() == -1) die("poller: io_uring_enter failed: {}", strerror(errno));
+        sqe = this->ring.next();
+      }
+      if (!sqe) {
+        retry[i] = true;
+        continue;
+      }
+      pending++;
+      sqe->opcode    = IORING_OP_STATX;
+      sqe->fd        = AT_FDCWD;
+      sqe->addr      = (u64)paths[i].c_str();
+      sqe->len       = STATX_MASK;
+      sqe->off       = (u64)&buffers[i];
+      sqe->user_data = i;
+    }
+    if (this->ring.submit(pending) == -1) die("poller: io_uring_enter failed: {}", strerror(errno));
+    u64 data;
+    i32 res;
+    while (pending) {
+      while (this->ring.reap(data, res)) {
+        pending--;
+        if (res == 0) {
+          stamps[data] = stamp_of(buffers[data]);
+        } else if (res == -EINVAL || res == -EOPNOTSUPP) { // kernels without IORING_OP_STATX
+          retry[data] = true;
+        }
+      }
+      if (pending && this->ring.submit(1) == -1) die("poller: io_uring_enter failed: {}", strerror(errno));
+    }
+  }
+  for (u64 i = 0; i < paths.size(); i++)
+    if (retry[i] && statx(AT_FDCWD, paths[i].c_str(), 0, STATX_MASK, &buffers[i]) == 0)
+      stamps[i] = stamp_of(buffers[i]);
+}
+
+// rereads the entries of the directory, reporting the differences unless it is the first time
+void poller_t::list(const path_t &path, directory_t &directory, std::queue<event_t> *events) {
+  std::map<std::string, bool> entries;
+  std::error_code ec;
+  for (auto &&entry : std::filesystem::directory_iterator(path, ec))
+    entries[entry.path().filename()] = entry.is_directory(ec);
+  for (auto &&[name, subdirectory] : directory.entries) {
+    if (entries.contains(name)) continue;
+    if (events) events->push(event_t{ path / name, IN_DELETE | (subdirectory ? IN_ISDIR : 0u) });
+    directory.files.erase(name);
+  }
+  std::vector<path_t> created;
+  for (auto &&[name, subdirectory] : entries) {
+    if (directory.entries.contains(name)) continue;
+    if (events) events->push(event_t{ path / name, IN_CREATE | (subdirectory ? IN_ISDIR : 0u) });
+    if (!subdirectory) created.push_back(path / name);
+  }
+  std::vector<std::optional<stamp_t>> stamps;
+  this->stat(created, stamps);
+  for (u64 i = 0; i < created.size(); i++) {
+    if (!stamps[i].has_value()) continue;
+    directory.files[created[i].filename()] = stamps[i].value();
+    // whatever is there by the time of the scan counts as written
+    if (events) events->push(event_t{ created[i], IN_CLOSE_WRITE });
+  }
+  directory.entries = std::move(entries);
+}
+
+void poller_t::arm(void) {
+  u64 due = 0;
+  for (auto &&[_, directory] : this->directories)
+    if (due == 0 || directory.due < due) due = directory.due;
+  const struct itimerspec spec = { .it_interval = {},
+                                   .it_value    = { .tv_sec = (time_t)(due / NS), .tv_nsec = (long)(due % NS) } };
+  if (timerfd_settime(this->timer, TFD_TIMER_ABSTIME, &spec, nullptr) == -1) die("poller: cannot arm timer");
+}
+
+void poller_t::add(const path_t &path, std::queue<event_t> *events) {
+  if (this->directories.contains(path)) return;
+  directory_t directory{
+    .stamp = {}, .files = {}, .entries = {}, .interval = MIN_INTERVAL, .due = now() + MIN_INTERVAL,
+  };
+  std::vector<std::optional<stamp_t>> stamps;
+  this->stat({ path }, stamps);
+  if (!stamps.front().has_value()) {
+    jot::warn("poller_t::add: cannot stat `{}`", path.string());
+    return;
+  }
+  directory.stamp = stamps.front().value();
+  this->list(path, directory, events);
+  jot::debug("polling `{}`", path.string());
+  this->directories[path] = std::move(directory);
+  // every change in there shows up in a scan, if late
+  meta::watch(path, true);
+  this->arm();
+}
+// the directory and everything below it, which sorts right after it
+void poller_t::remove(const path_t &path) {
+  auto it = this->directories.lower_bound(path);
+  while (it != this->directories.end()) {
+    auto [end, _] = std::mismatch(path.begin(), path.end(), it->first.begin(), it->first.end());
+    if (end != path.end()) break;
+    jot::debug("unpolling `{}`", it->first.string());
+    meta::unwatch(it->first);
+    it = this->directories.erase(it);
+  }
+}
+i32 poller_t::handle(void) const { return this->timer; }
+
+bool poller_t::scan(std::queue<event_t> &events) {
+  u64 expirations;
+  if (read(this->timer, &expirations, sizeof(expirations)) != sizeof(expirations)) return false;
+  const u64 start = cputime(), clock = now(), before = events.size();
+  std::vector<std::pair<const path_t, directory_t> *> due;
+  std::vector<path_t> paths;
+  for (auto &&entry : this->directories) {
+    if (entry.second.due > clock) continue;
+    due.push_back(&entry);
+    paths.push_back(entry.first);
+    for (auto &&[name, _] : entry.second.files) paths.push_back(entry.first / name);
+  }
+  std::vector<std::optional<stamp_t>> stamps;
+  this->stat(paths, stamps);
+  std::vector<path_t> gone;
+  u64 at = 0;
+  for (auto *entry : due) {
+    auto &[path, directory] = *entry;
+    const u64 mark          = events.size();
+    const auto self         = stamps[at++];
+    if (!self.has_value()) {
+      events.push(event_t{ path, IN_DELETE_SELF });
+      gone.push_back(path);
+      at += directory.files.size();
+      continue;
+    }
+    for (auto &&[name, stamp] : directory.files) {
+      const auto current = stamps[at++];
+      if (!current.has_value() || current.value() == stamp) continue;
+      stamp = current.value();
+      events.push(event_t{ path / name, IN_CLOSE_WRITE });
+    }
+    // entries only come and go along with the mtime of their directory
+    if (self.value() != directory.stamp) {
+      directory.stamp = self.value();
+      this->list(path, directory, &events);
+    }
+    directory.interval = events.size() > mark ? MIN_INTERVAL : std::min(directory.interval * 2, MAX_INTERVAL);
+    directory.due      = clock + directory.interval;
+  }
+  for (auto &&path : gone) this->remove(path);
+  const u64 spent = cputime() - start;
+  this->scans++;
+  this->cpu += spent;
+  jot::debug("poll: {} directories, {} files, {}us cpu", due.size(), paths.size() - due.size(), spent);
+  if (this->directories.size()) this->arm();
+  return events.size() > before;
+}
+
+void poller_t::report(void) const {
+  if (this->scans == 0) return;
+  jot::info("poll: {} scans, {:.1f}us cpu per scan", this->scans, (double)this->cpu / this->scans);
+}
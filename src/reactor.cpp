@@ -0,0 +1,53 @@
+#include <reactor.hpp>
+
+extern "C" {
+#include <sys/epoll.h>
+#include <unistd.h>
+}
+#include <cstring>
+#include <jot.hpp>
+#include <map>
+
+static i32 epfd     = -1;
+static bool running = false;
+static std::map<i32, handler_t> handlers;
+
+namespace reactor {
+void watch(i32 fd, handler_t handler) {
+  if (epfd == -1 && (epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) die("reactor: epoll_create1 failed: {}", strerror(errno));
+  struct epoll_event event;
+  std::memset(&event, 0, sizeof(event));
+  event.events  = EPOLLIN;
+  event.data.fd = fd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    jot::error("reactor: cannot watch fd {}: {}", fd, strerror(errno));
+    return;
+  }
+  handlers[fd] = std::move(handler);
+}
+void unwatch(i32 fd) {
+  if (!handlers.contains(fd)) return;
+  if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr) == -1) jot::warn("reactor: cannot unwatch fd {}", fd);
+  handlers.erase(fd);
+}
+void run(void) {
+  static constexpr u32 MAX_EVENTS = 64;
+  struct epoll_event events[MAX_EVENTS];
+  running = true;
+  while (running) {
+    i32 n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      die("reactor: epoll_wait failed: {}", strerror(errno));
+    }
+    for (i32 i = 0; i < n && running; i++) {
+      // handlers may unwatch themselves or others while the batch is dispatched
+      auto it = handlers.find(events[i].data.fd);
+      if (it == handlers.end()) continue;
+      auto handler = it->second;
+      handler(events[i].events);
+    }
+  }
+}
+void stop(void) { running = false; }
+} // namespace reactor
@@ -0,0 +1,211 @@
+#include <replay.hpp>
+
+extern "C" {
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+}
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <jot.hpp>
+#include <map>
+#include <reactor.hpp>
+#include <string>
+#include <vector>
+
+typedef std::filesystem::path path_t;
+
+static constexpr char MAGIC[8]  = { 'W', 'T', 'X', 'T', 'R', 'A', 'C', 'E' };
+static constexpr u32 VERSION    = 1;
+static constexpr u64 BATCH      = 256;         // events released per wakeup when replaying as fast as possible
+static constexpr u64 SETTLE_NS  = 100'000'000; // how often the pipeline is checked once the trace is exhausted
+static constexpr u64 NS         = 1'000'000'000;
+
+enum kind_t : u16 { WATCH, EVENT };
+
+// fixed part of a record, followed by `length` bytes of name: the watched path for WATCH, the inotify name for EVENT
+struct entry_t {
+  u64 ts; // nanoseconds since the recording started
+  i32 wd;
+  u32 mask;
+  u32 cookie;
+  u16 kind;
+  u16 length;
+};
+static_assert(sizeof(entry_t) == 24);
+
+struct item_t {
+  entry_t entry;
+  std::string name;
+};
+
+static u64 now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NS + ts.tv_nsec;
+}
+
+// recorder
+static std::FILE *output = nullptr;
+static u64 origin        = 0;
+
+static void put(kind_t kind, i32 wd, u32 mask, u32 cookie, std::string_view name) {
+  const entry_t entry = {
+    .ts = now() - origin, .wd = wd, .mask = mask, .cookie = cookie, .kind = kind, .length = (u16)name.size()
+  };
+  if (std::fwrite(&entry, sizeof(entry), 1, output) != 1 ||
+      std::fwrite(name.data(), 1, name.size(), output) != name.size()) {
+    jot::warn("replay: cannot write the trace, recording stopped");
+    std::fclose(output);
+    output = nullptr;
+  }
+}
+
+// player
+static std::vector<item_t> items;
+static u64 cursor = 0, released = 0, start = 0, drained = 0;
+static bool loaded = false, fast = false;
+static i32 timer   = -1;
+static path_t recorded, target;
+static std::map<i32, path_t> nodes;
+static std::function<bool(void)> settled;
+static std::map<std::string, std::vector<u64>, std::less<>> samples;
+static std::map<std::string, u64, std::less<>> tallies;
+
+static path_t relocate(const path_t &path) {
+  const path_t relative = path.lexically_relative(recorded);
+  if (relative.empty() || *relative.begin() == "..") return path;
+  return relative == "." ? target : target / relative;
+}
+
+static void arm(u64 at) {
+  const struct itimerspec spec = { .it_interval = {},
+                                   .it_value    = { .tv_sec = (time_t)(at / NS), .tv_nsec = (long)(at % NS) } };
+  if (timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, nullptr) == -1) die("replay: cannot arm timer");
+}
+
+static bool load(const path_t &file) {
+  std::FILE *input = std::fopen(file.c_str(), "r");
+  if (input == nullptr) return false;
+  char magic[sizeof(MAGIC)];
+  u32 version = 0, length = 0;
+  bool ok     = std::fread(magic, sizeof(magic), 1, input) == 1 && !std::memcmp(magic, MAGIC, sizeof(MAGIC));
+  ok          = ok && std::fread(&version, sizeof(version), 1, input) == 1 && version == VERSION;
+  ok          = ok && std::fread(&length, sizeof(length), 1, input) == 1;
+  std::string root(ok ? length : 0, '\0');
+  ok       = ok && std::fread(root.data(), 1, length, input) == length;
+  recorded = root;
+  for (item_t item; ok && std::fread(&item.entry, sizeof(item.entry), 1, input) == 1;) {
+    item.name.resize(item.entry.length);
+    ok = std::fread(item.name.data(), 1, item.entry.length, input) == item.entry.length;
+    if (ok) items.push_back(std::move(item));
+  }
+  std::fclose(input);
+  return ok;
+}
+
+static void report(void) {
+  const double elapsed = (drained - start) / 1e9;
+  jot::info("replay: {} events in {:.3f}s ({:.0f} events/s), {} builds", released, elapsed,
+            elapsed > 0 ? released / elapsed : 0.0, tallies["builds"]);
+  for (auto &&[stage, values] : samples) {
+    std::sort(values.begin(), values.end());
+    auto at = [&](double q) { return values[std::min<u64>(values.size() * q, values.size() - 1)] / 1e6; };
+    jot::info("  {:<8} n={:<5} p50={:.2f}ms p90={:.2f}ms max={:.2f}ms", stage, values.size(), at(0.5), at(0.9),
+              values.back() / 1e6);
+  }
+}
+
+namespace replay {
+void record(const path_t &file, const path_t &root) {
+  output = std::fopen(file.c_str(), "w");
+  if (output == nullptr) die("replay: cannot create `{}`: {}", file.string(), strerror(errno));
+  const u32 length = root.native().size();
+  std::fwrite(MAGIC, sizeof(MAGIC), 1, output);
+  std::fwrite(&VERSION, sizeof(VERSION), 1, output);
+  std::fwrite(&length, sizeof(length), 1, output);
+  std::fwrite(root.c_str(), 1, length, output);
+  origin = now();
+  jot::info("recording events to `{}`", file.string());
+}
+void watched(i32 wd, const path_t &path) {
+  if (output != nullptr) put(WATCH, wd, 0, 0, path.native());
+}
+void observed(const struct inotify_event *event) {
+  if (output != nullptr) put(EVENT, event->wd, event->mask, event->cookie, event->len ? event->name : "");
+}
+
+void play(const path_t &file, const path_t &root, bool asap, std::function<bool(void)> idle) {
+  if (!load(file)) die("replay: `{}` is not a readable trace", file.string());
+  target  = root;
+  fast    = asap;
+  settled = std::move(idle);
+  timer   = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer == -1) die("replay: cannot create timer");
+  loaded = true;
+  start  = now();
+  arm(items.empty() ? start : start + (fast ? 0 : items.front().entry.ts));
+  jot::info("replaying {} records from `{}`{}", items.size(), file.string(), fast ? " as fast as possible" : "");
+}
+bool playing(void) { return loaded; }
+i32 handle(void) { return timer; }
+
+bool due(std::queue<event_t> &events) {
+  u64 expirations;
+  if (read(timer, &expirations, sizeof(expirations)) != sizeof(expirations)) return false;
+  if (cursor == items.size()) {
+    if (!settled()) {
+      arm(now() + SETTLE_NS);
+    } else {
+      report();
+      reactor::stop();
+    }
+    return false;
+  }
+  const u64 clock = now() - start;
+  u64 count       = 0;
+  for (; cursor < items.size(); cursor++) {
+    const auto &item = items[cursor];
+    if (fast ? count == BATCH : item.entry.ts > clock) break;
+    if (item.entry.kind == WATCH) {
+      nodes[item.entry.wd] = relocate(item.name);
+      continue;
+    }
+    path_t path = nodes[item.entry.wd];
+    if (item.name.size()) path /= item.name;
+    events.push(event_t{ path, item.entry.mask });
+    count++;
+  }
+  released += count;
+  if (cursor < items.size()) {
+    arm(fast ? now() : start + items[cursor].entry.ts);
+  } else {
+    drained = now();
+    arm(drained + SETTLE_NS);
+  }
+  return count;
+}
+
+void sample(std::string_view stage, u64 ns) {
+  if (!loaded) return;
+  auto it = samples.find(stage);
+  if (it == samples.end()) it = samples.emplace(std::string(stage), std::vector<u64>()).first;
+  it->second.push_back(ns);
+}
+void tally(std::string_view what) {
+  if (!loaded) return;
+  auto it = tallies.find(what);
+  if (it == tallies.end()) it = tallies.emplace(std::string(what), 0).first;
+  it->second++;
+}
+
+void finish(void) {
+  if (output != nullptr) {
+    std::fclose(output);
+    output = nullptr;
+  }
+  if (timer != -1) close(timer);
+  timer = -1;
+}
+} // namespace replay
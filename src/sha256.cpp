@@ -0,0 +1,84 @@
+#include <sha256.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+static constexpr u32 K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static constexpr u32 rotr(u32 x, u32 n) { return (x >> n) | (x << (32 - n)); }
+
+sha256_t::sha256_t(void) : block{}, length(0) {
+  this->state = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+}
+
+void sha256_t::compress(const u8 *data) {
+  u32 w[64];
+  for (u32 i = 0; i < 16; i++)
+    w[i] = (u32)data[4 * i] << 24 | (u32)data[4 * i + 1] << 16 | (u32)data[4 * i + 2] << 8 | data[4 * i + 3];
+  for (u32 i = 16; i < 64; i++) {
+    const u32 s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    const u32 s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i]         = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  auto [a, b, c, d, e, f, g, h] = this->state;
+  for (u32 i = 0; i < 64; i++) {
+    const u32 t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+    const u32 t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h            = g;
+    g            = f;
+    f            = e;
+    e            = d + t1;
+    d            = c;
+    c            = b;
+    b            = a;
+    a            = t1 + t2;
+  }
+  const u32 next[8] = { a, b, c, d, e, f, g, h };
+  for (u32 i = 0; i < 8; i++) this->state[i] += next[i];
+}
+
+void sha256_t::add(const void *data, u64 size) {
+  const u8 *ptr = (const u8 *)data;
+  u64 used      = this->length % 64;
+  this->length += size;
+  if (used) {
+    const u64 take = std::min<u64>(64 - used, size);
+    std::memcpy(this->block.data() + used, ptr, take);
+    ptr += take;
+    size -= take;
+    if (used + take < 64) return;
+    this->compress(this->block.data());
+  }
+  for (; size >= 64; ptr += 64, size -= 64) this->compress(ptr);
+  std::memcpy(this->block.data(), ptr, size);
+}
+void sha256_t::add(std::string_view str) { this->add(str.data(), str.size()); }
+
+std::array<u8, 32> sha256_t::digest(void) {
+  const u64 bits = this->length * 8;
+  u8 tail[72]    = { 0x80 };
+  const u64 pad  = (this->length % 64 < 56 ? 56 : 120) - this->length % 64;
+  for (u32 i = 0; i < 8; i++) tail[pad + i] = bits >> (56 - 8 * i);
+  this->add(tail, pad + 8);
+  std::array<u8, 32> out;
+  for (u32 i = 0; i < 32; i++) out[i] = this->state[i / 4] >> (24 - 8 * (i % 4));
+  return out;
+}
+std::string sha256_t::hex(void) {
+  static constexpr char DIGITS[] = "0123456789abcdef";
+  std::string str;
+  for (auto &&byte : this->digest()) {
+    str += DIGITS[byte >> 4];
+    str += DIGITS[byte & 15];
+  }
+  return str;
+}
@@ -9,6 +9,7 @@ extern "C" {
 #include <map>
 #include <set>
 #include <string>
+#include <vector>
 
 static std::map<std::string, u64> *sizes    = nullptr;
 static std::map<void *, std::string> *addrs = nullptr;
@@ -148,9 +149,12 @@ void destroy(std::string_view key) {
   }
   const auto reference = keygen(key);
 
+  // drop erases from `addrs`, so the mounts are gathered first
+  std::vector<void *> mounted;
   for (auto &[addr, ref] : *addrs) {
-    if (ref == reference) drop(addr);
+    if (ref == reference) mounted.push_back(addr);
   }
+  for (auto addr : mounted) drop(addr);
   if (shm_unlink(reference.c_str()) == -1) {
     fmt::print(stderr, "shrdmm::destroy: shm_unlink failed ({})\n", strerror(errno));
     return;
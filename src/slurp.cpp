@@ -0,0 +1,214 @@
+#include <slurp.hpp>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+#include <cstring>
+#include <jot.hpp>
+#include <map>
+#include <memory>
+#include <uring.hpp>
+
+typedef std::filesystem::path path_t;
+
+static constexpr u32 RING_ENTRIES = 128;
+static constexpr u32 WINDOW       = RING_ENTRIES / 2; // every file has at most two operations in flight
+static constexpr u64 BLOCK        = 0x1000;
+static constexpr u64 POOL_LIMIT   = 0x4000000;
+
+// buffers are kept per thread and reused across loads, passes over many small files would otherwise churn the heap
+static thread_local std::multimap<u64, std::unique_ptr<char[]>> pool;
+static thread_local u64 pooled = 0;
+
+static std::unique_ptr<char[]> acquire(u64 size, u64 &capacity) {
+  auto it = pool.lower_bound(size + 1);
+  if (it != pool.end()) {
+    capacity    = it->first;
+    auto buffer = std::move(it->second);
+    pooled -= capacity;
+    pool.erase(it);
+    return buffer;
+  }
+  capacity = (size + 1 + BLOCK - 1) / BLOCK * BLOCK;
+  return std::make_unique<char[]>(capacity);
+}
+static void release(std::unique_ptr<char[]> buffer, u64 capacity) {
+  if (pooled + capacity > POOL_LIMIT) return;
+  pooled += capacity;
+  pool.emplace(capacity, std::move(buffer));
+}
+
+// private mapping with an anonymous tail, so that the terminator never lands past the end of the file
+static void map(const path_t &path, const consumer_t &consume) {
+  i32 fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    jot::warn("slurp: cannot open `{}`: {}", path.string(), strerror(errno));
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    jot::warn("slurp: cannot stat `{}`: {}", path.string(), strerror(errno));
+    close(fd);
+    return;
+  }
+  const u64 size    = st.st_size;
+  const u64 page    = sysconf(_SC_PAGESIZE);
+  const u64 reserve = (size + 1 + page - 1) / page * page;
+  void *base        = mmap(nullptr, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    jot::warn("slurp: mmap failed: {}", strerror(errno));
+    close(fd);
+    return;
+  }
+  if (size && mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    jot::warn("slurp: cannot map `{}`: {}", path.string(), strerror(errno));
+    munmap(base, reserve);
+    close(fd);
+    return;
+  }
+  close(fd);
+  if (size) madvise(base, size, MADV_SEQUENTIAL);
+  ((char *)base)[size] = 0;
+  consume(path, (char *)base, size);
+  munmap(base, reserve);
+}
+
+enum op_t : u8 { OPEN, STAT, READ };
+
+struct slot_t {
+  u64 index;
+  i32 fd;
+  i32 error;
+  u8 pending; // open and statx run side by side, reading starts when both are back
+  bool fallback;
+  struct statx stx;
+  std::unique_ptr<char[]> buffer;
+  u64 capacity, size, done;
+};
+
+namespace slurp {
+void load(const std::vector<path_t> &paths, const consumer_t &consume, const std::atomic<bool> *stop) {
+  static thread_local uring_t ring(RING_ENTRIES);
+  auto stopped = [&] { return stop && stop->load(std::memory_order_relaxed); };
+  if (!ring.ok()) {
+    for (auto &&path : paths) {
+      if (stopped()) return;
+      map(path, consume);
+    }
+    return;
+  }
+  std::vector<slot_t> slots(std::min<u64>(WINDOW, paths.size()));
+  std::vector<u32> idle;
+  for (u32 i = 0; i < slots.size(); i++) idle.push_back(i);
+
+  auto submit_read = [&](u32 id) {
+    auto &slot     = slots[id];
+    auto *sqe      = ring.next();
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = slot.fd;
+    sqe->addr      = (u64)(slot.buffer.get() + slot.done);
+    sqe->len       = slot.size - slot.done;
+    sqe->off       = slot.done;
+    sqe->user_data = ((u64)id << 2) | READ;
+  };
+  auto finish = [&](u32 id) {
+    auto &slot       = slots[id];
+    const auto &path = paths[slot.index];
+    if (slot.fallback) {
+      map(path, consume);
+    } else if (slot.error) {
+      jot::warn("slurp: cannot read `{}`: {}", path.string(), strerror(slot.error));
+    } else {
+      slot.buffer[slot.size] = 0;
+      consume(path, slot.buffer.get(), slot.size);
+    }
+    if (slot.buffer) release(std::move(slot.buffer), slot.capacity);
+    if (slot.fd != -1) close(slot.fd);
+    idle.push_back(id);
+  };
+  // old kernels know io_uring but not these opcodes
+  auto failed = [&](slot_t &slot, i32 res) {
+    if (res == -EINVAL || res == -EOPNOTSUPP) {
+      slot.fallback = true;
+    } else if (!slot.error) {
+      slot.error = -res;
+    }
+  };
+
+  u64 next = 0, active = 0;
+  while ((next < paths.size() && !stopped()) || active) {
+    while (next < paths.size() && idle.size() && !stopped()) {
+      const u32 id = idle.back();
+      idle.pop_back();
+      auto &slot       = slots[id];
+      slot             = slot_t{
+        .index    = next++,
+        .fd       = -1,
+        .error    = 0,
+        .pending  = 2,
+        .fallback = false,
+        .stx      = {},
+        .buffer   = nullptr,
+        .capacity = 0,
+        .size     = 0,
+        .done     = 0,
+      };
+      const char *name = paths[slot.index].c_str();
+      auto *sqe        = ring.next();
+      sqe->opcode      = IORING_OP_OPENAT;
+      sqe->fd          = AT_FDCWD;
+      sqe->addr        = (u64)name;
+      sqe->open_flags  = O_RDONLY | O_CLOEXEC;
+      sqe->user_data   = ((u64)id << 2) | OPEN;
+      sqe              = ring.next();
+      sqe->opcode      = IORING_OP_STATX;
+      sqe->fd          = AT_FDCWD;
+      sqe->addr        = (u64)name;
+      sqe->len         = STATX_SIZE;
+      sqe->off         = (u64)&slot.stx;
+      sqe->user_data   = ((u64)id << 2) | STAT;
+      active++;
+    }
+    if (ring.submit(1) == -1) die("slurp: io_uring_enter failed: {}", strerror(errno));
+    u64 data;
+    i32 res;
+    while (ring.reap(data, res)) {
+      const u32 id = data >> 2;
+      auto &slot   = slots[id];
+      switch ((op_t)(data & 3)) {
+      case OPEN:
+      case STAT:
+        if (res < 0) failed(slot, res);
+        if ((op_t)(data & 3) == OPEN && res >= 0) slot.fd = res;
+        if (--slot.pending) break;
+        if (!slot.error && !slot.fallback) {
+          slot.size   = slot.stx.stx_size;
+          slot.done   = 0;
+          slot.buffer = acquire(slot.size, slot.capacity);
+        }
+        if (slot.error || slot.fallback || slot.size == 0) {
+          finish(id);
+          active--;
+          break;
+        }
+        submit_read(id);
+        break;
+      case READ:
+        if (res < 0) failed(slot, res);
+        if (res > 0) slot.done += res;
+        if (res > 0 && slot.done < slot.size) { // short read
+          submit_read(id);
+          break;
+        }
+        slot.size = slot.done; // the file may have shrunk meanwhile
+        finish(id);
+        active--;
+        break;
+      }
+    }
+  }
+}
+} // namespace slurp
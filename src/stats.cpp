@@ -0,0 +1,150 @@
+#include <stats.hpp>
+
+extern "C" {
+#include <sys/timerfd.h>
+#include <unistd.h>
+}
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fmt/format.h>
+#include <jot.hpp>
+#include <reactor.hpp>
+#include <shrdmm.hpp>
+
+typedef std::filesystem::path path_t;
+
+static constexpr u64 CAPACITY   = 0x800; // power of two, probing wraps with a mask
+static constexpr u64 MAGIC      = 0x7374617478746177;
+static constexpr i64 SNAPSHOT_S = 5;
+
+// first row of the segment, the records follow
+struct alignas(64) header_t {
+  u64 magic;
+  u32 capacity, nflags;
+  std::atomic<u64> used, dropped;
+};
+
+static header_t *header = nullptr;
+static record_t *table  = nullptr;
+static std::string key;
+static std::optional<path_t> target;
+static i32 timer = -1;
+
+// FNV-1a over the path, stable across runs so that readers can look files up by hashing them too
+static u64 identify(const path_t &path) {
+  u64 hash = 0xcbf29ce484222325;
+  for (const char c : path.native()) {
+    hash ^= (u8)c;
+    hash *= 0x100000001b3;
+  }
+  return hash ? hash : 1;
+}
+
+// exits through die() skip deinit(), the segment would outlive the process
+static void discard(void) {
+  if (table == nullptr) return;
+  shrdmm::destroy(key);
+  header = nullptr;
+  table  = nullptr;
+}
+
+namespace stats {
+void init(std::optional<path_t> snapshot) {
+  key             = fmt::format("stats/{}", getpid());
+  const u64 bytes = sizeof(header_t) + CAPACITY * sizeof(record_t);
+  shrdmm::create(key, bytes);
+  void *base = shrdmm::mount(key);
+  if (base == nullptr) {
+    jot::warn("stats: cannot map the table, statistics are disabled");
+    return;
+  }
+  header = new (base) header_t{ .magic = MAGIC, .capacity = CAPACITY, .nflags = NFLAGS, .used = 0, .dropped = 0 };
+  table  = (record_t *)(header + 1);
+  for (u64 i = 0; i < CAPACITY; i++) new (&table[i]) record_t();
+  std::atexit(discard);
+  jot::debug("stats: table at /dev/shm/watchtex-stats-{}", getpid());
+  if (!snapshot.has_value()) return;
+  target = snapshot;
+  timer  = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer == -1) die("cannot create snapshot timer");
+  const struct itimerspec period = { .it_interval = { .tv_sec = SNAPSHOT_S, .tv_nsec = 0 },
+                                     .it_value    = { .tv_sec = SNAPSHOT_S, .tv_nsec = 0 } };
+  if (timerfd_settime(timer, 0, &period, nullptr) == -1) die("cannot arm snapshot timer");
+  reactor::watch(timer, [](u32) {
+    u64 expirations;
+    if (read(timer, &expirations, sizeof(expirations)) == sizeof(expirations)) stats::snapshot();
+  });
+}
+void deinit(void) {
+  if (table == nullptr) return;
+  if (timer != -1) {
+    snapshot();
+    reactor::unwatch(timer);
+    close(timer);
+    timer = -1;
+  }
+  discard();
+}
+
+const record_t *update(const path_t &path, u32 mask) {
+  if (table == nullptr) return nullptr;
+  const u64 id = identify(path);
+  for (u64 i = id & (CAPACITY - 1), probes = 0; probes < CAPACITY; i = (i + 1) & (CAPACITY - 1), probes++) {
+    record_t &record = table[i];
+    u64 current      = record.id.load(std::memory_order_acquire);
+    if (current == 0 && record.id.compare_exchange_strong(current, id, std::memory_order_acq_rel)) {
+      std::strncpy(record.name, path.c_str(), sizeof(record.name) - 1);
+      header->used.fetch_add(1, std::memory_order_relaxed);
+      current = id;
+    }
+    // equal hashes of different paths take separate rows, like any other collision in the probe sequence
+    if (current != id || std::strncmp(record.name, path.c_str(), sizeof(record.name) - 1)) continue;
+    // one step per set bit instead of one per known flag
+    for (; mask; mask &= mask - 1) {
+      const u8 slot = SLOTS[__builtin_ctz(mask)];
+      if (slot < NFLAGS) record.count[slot].fetch_add(1, std::memory_order_relaxed);
+    }
+    return &record;
+  }
+  header->dropped.fetch_add(1, std::memory_order_relaxed);
+  return nullptr;
+}
+
+std::vector<const record_t *> records(void) {
+  std::vector<const record_t *> claimed;
+  if (table == nullptr) return claimed;
+  for (u64 i = 0; i < CAPACITY; i++)
+    if (table[i].id.load(std::memory_order_acquire)) claimed.push_back(&table[i]);
+  std::sort(claimed.begin(), claimed.end(),
+            [](const record_t *a, const record_t *b) { return std::strcmp(a->name, b->name) < 0; });
+  return claimed;
+}
+
+// tab separated, one row per file, renamed into place so that readers never see half of it
+void snapshot(void) {
+  if (table == nullptr || !target.has_value()) return;
+  path_t temporary = target.value();
+  temporary += ".tmp";
+  std::FILE *file = std::fopen(temporary.c_str(), "w");
+  if (file == nullptr) {
+    jot::warn("stats: cannot write `{}`: {}", temporary.string(), strerror(errno));
+    return;
+  }
+  fmt::print(file, "path");
+  for (auto &&name : FLAGSSTR) fmt::print(file, "\t{}", name);
+  fmt::print(file, "\n");
+  for (auto *record : records()) {
+    fmt::print(file, "{}", record->name);
+    for (auto &&count : record->count) fmt::print(file, "\t{}", count.load(std::memory_order_relaxed));
+    fmt::print(file, "\n");
+  }
+  if (const u64 dropped = header->dropped.load(std::memory_order_relaxed))
+    fmt::print(file, "# {} events dropped, table full\n", dropped);
+  const bool failed = std::ferror(file);
+  std::fclose(file);
+  std::error_code ec;
+  if (!failed) std::filesystem::rename(temporary, target.value(), ec);
+  if (failed || ec) jot::warn("stats: cannot write `{}`", target->string());
+}
+} // namespace stats
@@ -1,18 +1,40 @@
 #include <tex.hpp>
 
+#include <algorithm>
 #include <atomic>
+#include <cache.hpp>
+#include <cgroup.hpp>
+#include <chrono>
 #include <clone3.hpp>
+#include <cmath>
 #include <csignal>
+#include <cstring>
 #include <fstream>
+#include <iterator>
 #include <jot.hpp>
+#include <memory>
+#include <meta.hpp>
 #include <mutex>
 #include <optional>
+#include <options.hpp>
+#include <reactor.hpp>
+#include <replay.hpp>
 #include <rkhash.hpp>
+#include <set>
+#include <slurp.hpp>
+#include <string>
+#include <thread>
+#include <trace.hpp>
+#include <tuple>
 #include <utility>
 #include <vector>
 
 extern "C" {
 #include <fcntl.h>
+#include <linux/ioprio.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 }
@@ -22,6 +44,7 @@ typedef std::filesystem::path path_t;
 using hash = hash_t<0x3dad792b, 0x37f5bdcb, 0x3ce6a7af, 0x318d14ef>;
 
 static void remove_comments(char *content, u64 size) {
+  TRACE_SPAN(remove_comments, size);
   static constexpr char NOCOMMENT = '?';
 
   if (content == nullptr) return;
@@ -74,121 +97,494 @@ static std::optional<std::string> next_token(const char *ptr) {
   return std::string(ptr + 1, len - 1);
 }
 
-static char *next_include(char *ptr) {
-  static hash COMMANDS[] = {
-    hash("\\input"),
-    hash("\\include"),
-    hash("\\includeonly"),
-  };
+struct command_t {
+  hash name;
+  dep_t kind;
+  bool list;                        // argument is a comma separated list
+  std::vector<std::string_view> ext; // suffixes tried in order when resolving
+  const char *variable;             // search path consulted after the directory of the including file
+};
+
+static const command_t COMMANDS[] = {
+  { hash("\\input"), dep_t::input, false, { "", ".tex" }, "TEXINPUTS" },
+  { hash("\\include"), dep_t::include, false, { ".tex" }, "TEXINPUTS" },
+  { hash("\\bibliography"), dep_t::bibliography, true, { ".bib" }, "BIBINPUTS" },
+  { hash("\\addbibresource"), dep_t::bibliography, false, { "" }, "BIBINPUTS" },
+  { hash("\\usepackage"), dep_t::style, true, { ".sty" }, "TEXINPUTS" },
+  { hash("\\RequirePackage"), dep_t::style, true, { ".sty" }, "TEXINPUTS" },
+  { hash("\\documentclass"), dep_t::style, false, { ".cls" }, "TEXINPUTS" },
+  { hash("\\LoadClass"), dep_t::style, false, { ".cls" }, "TEXINPUTS" },
+  { hash("\\includegraphics"), dep_t::graphic, false, { "", ".pdf", ".png", ".jpg", ".jpeg", ".eps" }, "TEXINPUTS" },
+  { hash("\\lstinputlisting"), dep_t::listing, false, { "" }, "TEXINPUTS" },
+};
+
+static bool is_letter(char c) { return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z'); }
+// ascii only, std::isspace is undefined for the bytes of utf-8 file names
+static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v'; }
+
+// returns the position of the mandatory argument of the next dependency command, skipping stars and options
+static char *next_include(char *ptr, const command_t *&command) {
+  TRACE_SPAN(next_include);
   if (ptr == nullptr) return nullptr;
-  for (auto &&mask : COMMANDS) {
-    hash span;
-    u64 i;
-    for (i = 0; i < mask.length && ptr[i]; i++) span.add_right(ptr[i]);
-    if (span == mask) return ptr + mask.length;
-    for (; ptr[i]; i++) {
-      span.remove_left(ptr[i - mask.length]);
-      span.add_right(ptr[i]);
-      if (span == mask) return ptr + i + 1;
+  while ((ptr = std::strchr(ptr, '\\'))) {
+    u64 len = 1;
+    while (is_letter(ptr[len])) len++;
+    if (len == 1) { // control symbol, e.g. `\\`
+      ptr += ptr[1] ? 2 : 1;
+      continue;
     }
+    const hash name(std::string_view(ptr, len));
+    ptr += len;
+    command = nullptr;
+    for (auto &&candidate : COMMANDS)
+      if (candidate.name == name) command = &candidate;
+    if (command == nullptr) continue;
+    if (*ptr == '*') ptr++;
+    while (is_space(*ptr)) ptr++;
+    while (*ptr == '[') {
+      u64 opened = 0;
+      do {
+        if (*ptr == '[') opened++;
+        if (*ptr == ']') opened--;
+        ptr++;
+      } while (opened && *ptr);
+      while (is_space(*ptr)) ptr++;
+    }
+    if (*ptr == '{') return ptr;
   }
   return nullptr;
 }
 
-static void compile(path_t path);
+// kpathsea style list of directories, relative ones are taken from the including file like the includes are.
+// empty elements stand for the system tree, which is not tracked, and `//` is searched without its subdirectories
+static const std::vector<path_t> &search_path(const char *variable) {
+  static const auto PATHS = [] {
+    std::map<std::string_view, std::vector<path_t>> paths;
+    for (std::string_view name : { "TEXINPUTS", "BIBINPUTS" }) {
+      const char *value = std::getenv(std::string(name).c_str());
+      for (std::string_view rest = value ? value : ""; rest.size();) {
+        const u64 colon    = rest.find(':');
+        std::string_view element = rest.substr(0, colon);
+        while (element.ends_with('/') && element.size() > 1) element.remove_suffix(1);
+        if (element.size() && element != ".") paths[name].emplace_back(element);
+        rest = colon == std::string_view::npos ? "" : rest.substr(colon + 1);
+      }
+    }
+    return paths;
+  }();
+  static const std::vector<path_t> NONE;
+  const auto it = PATHS.find(variable);
+  return it == PATHS.end() ? NONE : it->second;
+}
 
-namespace tex {
-void analyze(path_t path, graph_t &deps, graph_t &roots) {
-  path = std::filesystem::canonical(path);
-  path = std::filesystem::absolute(path);
-  if (!std::filesystem::exists(path)) {
-    jot::warn("analyze: path `{}` does not exist", path.string());
-    return;
-  }
-  if (std::filesystem::is_regular_file(path) && path.extension() == ".tex") {
-    // clear previous dependencies
-    for (auto &&dep : deps[path]) roots[dep].erase(path);
-    deps[path].clear();
-    path_t directory = path.parent_path();
-    const u64 size   = std::filesystem::file_size(path);
-    if (size == 0) {
-      jot::warn("analyze: path `{}` is empty", path.string());
-      return;
+// search path elements can lead out of the watched tree, what is found there is read but never watched
+static void outside(const path_t &dep) {
+  static std::mutex lock;
+  static std::set<path_t> warned;
+  const path_t &root = options::get().root;
+  auto [end, _]      = std::mismatch(root.begin(), root.end(), dep.begin(), dep.end());
+  if (end == root.end()) return;
+  std::lock_guard guard(lock);
+  if (warned.insert(dep).second)
+    jot::warn("analyze: `{}` is outside of `{}`, edits there do not trigger builds", dep.string(), root.string());
+}
+
+static std::optional<path_t> resolve(const path_t &directory, std::string_view name, const command_t &command) {
+  while (name.size() && is_space(name.front())) name.remove_prefix(1);
+  while (name.size() && is_space(name.back())) name.remove_suffix(1);
+  if (name.empty()) return std::nullopt;
+  auto find = [&](const path_t &base) -> std::optional<path_t> {
+    for (auto &&ext : command.ext) {
+      const meta::entry_t entry = meta::lookup(base / fmt::format("{}{}", name, ext));
+      if (entry.kind == meta::kind_t::regular) return entry.canonical;
     }
-    char *content = new char[size + 1];
-    {
-      std::ifstream input(path, std::ios::binary);
-      input.read(content, size);
-      content[size] = 0;
-      input.close();
+    return std::nullopt;
+  };
+  if (auto dep = find(directory)) return dep;
+  for (auto &&base : search_path(command.variable)) {
+    if (auto dep = find(directory / base)) {
+      outside(dep.value());
+      return dep;
     }
-    remove_comments(content, size);
-    char *ptr = content;
-    while ((ptr = next_include(ptr))) {
-      auto token = next_token(ptr);
-      if (!token.has_value()) continue;
-      path_t dep = directory / token.value();
-      if (!std::filesystem::exists(dep)) {
-        jot::warn("analyze: path `{}` does not exist", dep.string());
-        continue;
-      }
-      if (std::filesystem::is_regular_file(dep) && dep.extension() == ".tex") {
-        deps[path].insert(dep);
-        roots[dep].insert(path);
-      } else {
-        jot::warn("analyze: dependency `{}` not supported", dep.string());
-      }
+  }
+  // packages and classes are mostly installed system wide, only local ones are tracked
+  if (command.kind != dep_t::style) jot::warn("analyze: dependency `{}` does not exist", (directory / name).string());
+  return std::nullopt;
+}
+
+// what a rebuild has to go through, ordered from the cheapest
+enum class stage_t : u8 {
+  final,        // latex passes only, e.g. a figure changed
+  bibliography, // bibtex/biber followed by the latex passes
+  full,         // everything, left to rubber
+};
+
+static stage_t stage_of(dep_t kind) {
+  switch (kind) {
+  case dep_t::bibliography: return stage_t::bibliography;
+  case dep_t::graphic:
+  case dep_t::listing: return stage_t::final;
+  default: return stage_t::full;
+  }
+}
+
+// part of the cache key, outputs of other compilers or flags must not be mixed up
+static constexpr std::string_view BACKEND = "rubber --pdf --unsafe; pdflatex -interaction=batchmode -shell-escape";
+
+static void compile(path_t path, stage_t stage, const std::set<path_t> &chapters, const std::set<path_t> &includes,
+                    std::optional<state_t> key);
+
+// set on exit, background analysis stops at the next file
+static std::atomic<bool> abandoned = false;
+
+// sources below the canonical `path`, canonical like the ones coming from the watcher. the types come with the
+// directory entries, only symlinks need resolving
+static void collect(const path_t &path, std::vector<path_t> &files) {
+  std::error_code ec;
+  for (auto &&entry : std::filesystem::directory_iterator(path, ec)) {
+    if (abandoned.load(std::memory_order_relaxed)) return;
+    if (entry.path().extension() == ".tex" && entry.is_regular_file(ec)) {
+      files.push_back(entry.is_symlink(ec) ? meta::lookup(entry.path()).canonical : entry.path());
+    } else if (entry.is_directory(ec) && entry.path().filename() != "node_modules") {
+      collect(entry.is_symlink(ec) ? meta::lookup(entry.path()).canonical : entry.path(), files);
     }
-    delete[] content;
-  } else if (std::filesystem::is_directory(path)) {
-    for (auto &&entry : std::filesystem::directory_iterator(path)) {
-      bool ok = false;
-      ok      = ok || (std::filesystem::is_regular_file(entry) && entry.path().extension() == ".tex");
-      ok      = ok || (std::filesystem::is_directory(entry) && entry.path().filename() != "node_modules");
-      if (!ok) continue;
-      analyze(entry, deps, roots);
+  }
+}
+
+typedef std::map<path_t, dep_t> edges_t;
+
+// dependencies of a single source, touches nothing but `content` so that workers can run it side by side
+static edges_t scan(const path_t &path, char *content, u64 size) {
+  TRACE_SPAN(scan, path.c_str(), size);
+  edges_t edges;
+  path_t directory = path.parent_path();
+  if (size == 0) {
+    jot::warn("analyze: path `{}` is empty", path.string());
+    return edges;
+  }
+  remove_comments(content, size);
+  char *ptr                = content;
+  const command_t *command = nullptr;
+  while ((ptr = next_include(ptr, command))) {
+    auto token = next_token(ptr);
+    ptr++;
+    if (!token.has_value()) continue;
+    std::string_view names = token.value();
+    while (true) {
+      const u64 comma = command->list ? names.find(',') : std::string_view::npos;
+      auto dep        = resolve(directory, names.substr(0, comma), *command);
+      if (dep.has_value() && dep.value() != path) edges[dep.value()] = command->kind;
+      if (comma == std::string_view::npos) break;
+      names.remove_prefix(comma + 1);
     }
+  }
+  return edges;
+}
+
+// inputs of the live graph whose users changed, consumed by tex::touched()
+static std::set<path_t> retouched;
+
+// replaces the previous dependencies of `path`, noting the inputs affected in `touched`
+static void install(const path_t &path, edges_t edges, graph_t &deps, graph_t &roots, std::set<path_t> *touched) {
+  for (auto &&[dep, _] : deps[path]) {
+    roots[dep].erase(path);
+    if (touched) touched->insert(dep);
+  }
+  for (auto &&[dep, kind] : edges) {
+    roots[dep][path] = kind;
+    if (touched) touched->insert(dep);
+  }
+  deps[path] = std::move(edges);
+}
+
+static constexpr u64 SHARD = 64; // files a worker reads in one go, small batches are not worth a thread
+
+// workers pull shards and keep what they find to themselves, the graphs are only touched afterwards, in the
+// order of `files`, so that the outcome does not depend on the scheduling
+static void analyze(const std::vector<path_t> &files, graph_t &deps, graph_t &roots,
+                    std::set<path_t> *touched = &retouched) {
+  TRACE_SPAN(analyze, files.size());
+  const u64 shards  = (files.size() + SHARD - 1) / SHARD;
+  const u64 workers = std::min<u64>(std::max(std::thread::hardware_concurrency(), 1u), shards);
+  std::vector<std::vector<std::pair<u64, edges_t>>> found(std::max<u64>(workers, 1));
+  std::atomic<u64> next = 0;
+  auto work             = [&](u64 worker) {
+    for (u64 shard; !abandoned && (shard = next.fetch_add(1, std::memory_order_relaxed)) < shards;) {
+      const u64 first = shard * SHARD, last = std::min<u64>(first + SHARD, files.size());
+      const std::vector<path_t> batch(files.begin() + first, files.begin() + last);
+      // files are scanned as they arrive, while the rest of the shard is still being read
+      slurp::load(
+        batch,
+        [&](const path_t &file, char *content, u64 size) {
+          if (abandoned.load(std::memory_order_relaxed)) return;
+          found[worker].emplace_back(first + (&file - batch.data()), scan(file, content, size));
+        },
+        &abandoned);
+    }
+  };
+  if (workers <= 1) {
+    work(0);
+  } else {
+    std::vector<std::thread> pool;
+    for (u64 i = 0; i < workers; i++) pool.emplace_back(work, i);
+    for (auto &&thread : pool) thread.join();
+  }
+  std::vector<std::pair<u64, edges_t>> merged;
+  for (auto &&list : found) std::move(list.begin(), list.end(), std::back_inserter(merged));
+  std::sort(merged.begin(), merged.end(), [](auto &&a, auto &&b) { return a.first < b.first; });
+  for (auto &&[index, edges] : merged) install(files[index], std::move(edges), deps, roots, touched);
+  jot::debug("analyze: {} files on {} thread(s)", files.size(), workers);
+}
+
+// canonical sources behind `path`, a single file or every one below a directory
+static bool gather(const path_t &path, std::vector<path_t> &files) {
+  const meta::entry_t entry = meta::lookup(std::filesystem::absolute(path));
+  if (entry.kind == meta::kind_t::missing) {
+    jot::warn("analyze: path `{}` does not exist", path.string());
+    return false;
+  }
+  if (entry.kind == meta::kind_t::regular && entry.canonical.extension() == ".tex") {
+    files.push_back(entry.canonical);
+  } else if (entry.kind == meta::kind_t::directory) {
+    collect(entry.canonical, files);
   } else {
     jot::warn("analyze: path `{}` is not analyzable", path.string());
+    return false;
+  }
+  return true;
+}
+
+// the survey runs on its own thread into a private graph, which is merged on the main thread once it is done
+static std::thread surveyor;
+static i32 surveyed = -1;
+static bool merged  = false;
+static graph_t surveyed_deps;
+
+static void merge(graph_t &deps, graph_t &roots) {
+  u64 adopted = 0;
+  for (auto &&[file, edges] : surveyed_deps) {
+    // analyzed on demand meanwhile, from a newer state of the file
+    if (deps.contains(file)) continue;
+    for (auto &&[dep, kind] : edges) {
+      roots[dep][file] = kind;
+      retouched.insert(dep);
+    }
+    deps[file] = std::move(edges);
+    adopted++;
+  }
+  jot::debug("survey: {} of {} files merged", adopted, surveyed_deps.size());
+  surveyed_deps.clear();
+}
+
+namespace tex {
+void analyze(path_t path, graph_t &deps, graph_t &roots) {
+  std::vector<path_t> files;
+  if (gather(path, files)) ::analyze(files, deps, roots);
+}
+
+void survey(path_t path, graph_t &deps, graph_t &roots, std::function<void(void)> done) {
+  surveyed = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (surveyed == -1) {
+    jot::warn("survey: cannot create eventfd, analyzing in the foreground");
+    analyze(path, deps, roots);
+    merged = true;
+    done();
     return;
   }
+  const auto start = std::chrono::steady_clock::now();
+  reactor::watch(surveyed, [&deps, &roots, start, done](u32) {
+    u64 value;
+    if (read(surveyed, &value, sizeof(value)) != sizeof(value)) return;
+    surveyor.join();
+    reactor::unwatch(surveyed);
+    close(surveyed);
+    surveyed = -1;
+    merge(deps, roots);
+    merged               = true;
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    jot::info("dependency graph ready [{} files, {:.2f}s]", deps.size(), elapsed);
+    done();
+  });
+  surveyor = std::thread([path] {
+    std::vector<path_t> files;
+    graph_t roots;
+    // a private graph, the inputs are noted once it is merged
+    if (gather(path, files)) ::analyze(files, surveyed_deps, roots, nullptr);
+    const u64 one = 1;
+    if (write(surveyed, &one, sizeof(one)) != sizeof(one)) jot::warn("survey: cannot signal completion");
+  });
+}
+bool ready(void) { return merged; }
+std::set<path_t> touched(void) { return std::exchange(retouched, {}); }
+
+void analyze_ancestors(const path_t &path, const path_t &top, graph_t &deps, graph_t &roots) {
+  std::vector<path_t> files;
+  std::error_code ec;
+  auto sources = [&](const path_t &directory) {
+    for (auto &&entry : std::filesystem::directory_iterator(directory, ec)) {
+      if (entry.path().extension() != ".tex" || !entry.is_regular_file(ec)) continue;
+      const path_t file = entry.is_symlink(ec) ? meta::lookup(entry.path()).canonical : entry.path();
+      if (!deps.contains(file)) files.push_back(file);
+    }
+  };
+  // each ancestor with its direct subdirectories, which catches `main/` pulling in `../chapters/`
+  path_t below;
+  for (path_t directory = path.parent_path();; below = directory, directory = directory.parent_path()) {
+    sources(directory);
+    for (auto &&entry : std::filesystem::directory_iterator(directory, ec))
+      if (entry.path() != below && entry.path().filename() != "node_modules" && entry.is_directory(ec))
+        sources(entry.path());
+    if (directory == top || directory == directory.parent_path()) break;
+  }
+  if (files.empty()) return;
+  jot::debug("analyze: {} candidates above `{}`", files.size(), path.string());
+  ::analyze(files, deps, roots);
+}
+
+bool standalone(const path_t &path) {
+  std::ifstream input(path, std::ios::binary);
+  std::string content{ std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>() };
+  remove_comments(content.data(), content.size());
+  return content.find("\\documentclass") != std::string::npos || content.find("\\documentstyle") != std::string::npos;
+}
+
+bool trackable(const path_t &path) {
+  const std::string ext = path.extension().string();
+  for (auto &&command : COMMANDS)
+    for (auto &&suffix : command.ext)
+      if (suffix.size() && suffix == ext) return true;
+  return false;
+}
+
+// every \include below `path`, latex writes their .aux files next to the root's under the same relative name
+static std::set<path_t> includes_of(const path_t &path, const graph_t &deps) {
+  std::set<path_t> seen{ path }, includes;
+  std::vector<path_t> stack{ path };
+  while (stack.size()) {
+    const path_t next = stack.back();
+    stack.pop_back();
+    if (!deps.contains(next)) continue;
+    for (auto &&[dep, kind] : deps.at(next)) {
+      if (kind == dep_t::include) includes.insert(dep);
+      if ((kind == dep_t::include || kind == dep_t::input) && seen.insert(dep).second) stack.push_back(dep);
+    }
+  }
+  return includes;
 }
 
-void build(const path_t &path, const graph_t &, const graph_t &roots) {
-  std::vector<path_t> todo;
+void build(const std::set<path_t> &paths, const graph_t &deps, const graph_t &roots) {
+  std::map<path_t, stage_t> todo;
+  // top-level \include of each root that the changes fall into, roots changed outside of them go in `whole`
+  std::map<path_t, std::set<path_t>> chapters;
+  std::set<path_t> whole;
   {
-    std::vector<path_t> queue;
-    queue.push_back(path);
+    TRACE_SPAN(plan, paths.size());
+    // the edges of a changed file decide the stage, the ones above it just carry it up to the roots
+    typedef std::optional<path_t> chapter_t;
+    std::map<std::pair<path_t, chapter_t>, stage_t> seen;
+    std::vector<std::tuple<path_t, stage_t, bool, chapter_t>> queue;
+    for (auto &&path : paths) queue.emplace_back(path, stage_t::full, true, std::nullopt);
     while (queue.size()) {
-      auto next = queue.back();
+      auto [next, stage, changed, chapter] = queue.back();
       queue.pop_back();
+      const auto key = std::make_pair(next, chapter);
+      if (!changed && seen.contains(key) && seen.at(key) >= stage) continue;
+      seen[key] = std::max(seen[key], stage);
       if (roots.contains(next) && roots.at(next).size()) {
-        for (auto &&root : roots.at(next)) queue.push_back(root);
+        for (auto &&[root, kind] : roots.at(next))
+          queue.emplace_back(root, changed ? stage_of(kind) : stage, false, kind == dep_t::include ? next : chapter);
       } else {
-        todo.push_back(next);
+        todo[next] = std::max(todo[next], stage);
+        if (chapter.has_value()) {
+          chapters[next].insert(chapter.value());
+        } else {
+          whole.insert(next);
+        }
       }
     }
   }
-  for (auto &&path : todo) compile(path);
+  for (auto &&[path, stage] : todo) {
+    const bool preview = options::get().preview && !whole.contains(path);
+    std::optional<state_t> key;
+    // replayed builds are stubs, their outputs must not end up in the cache nor come from it
+    if (cache::enabled() && !replay::playing()) key = cache::key(path, deps, BACKEND);
+    const std::set<path_t> includes = options::get().outdir.has_value() ? includes_of(path, deps) : std::set<path_t>();
+    compile(path, stage, preview ? chapters[path] : std::set<path_t>(), includes, key);
+  }
 }
 } // namespace tex
 
-struct job_t {
-  i32 pid;
-  std::map<path_t, job_t> *jobs;
-  path_t path;
-  std::mutex *mutex;
-  void *stack;
-  bool done;
+static constexpr u64 STACK_SIZE        = 0x1000000;
+static constexpr i32 DEFERRED_NICENESS = 10;
+
+struct spawn_t {
+  const char *workdir;
+  char *const *argv;
+  char *const *envp;
+  i32 niceness;
+  u32 policy;
+  u16 ioprio;
 };
 
-static constexpr u64 STACK_SIZE = 0x1000000;
+// layout of linux/sched/types.h, which clashes with glibc's <sched.h>
+struct sched_attr_t {
+  u32 size, sched_policy;
+  u64 sched_flags;
+  i32 sched_nice;
+  u32 sched_priority;
+  u64 sched_runtime, sched_deadline, sched_period;
+};
+
+struct step_t {
+  std::vector<std::string> argv;
+  bool rerun;    // repeated while latex asks for another pass
+  bool deferred; // catches up after a preview, at low priority
+};
+
+// where the artifacts of `path` are produced, mirroring the watched tree when an output directory is set
+static path_t workdir_of(const path_t &path) {
+  const auto &outdir = options::get().outdir;
+  if (!outdir.has_value()) return path.parent_path();
+  return outdir.value() / path.parent_path().lexically_relative(options::get().root);
+}
+
+// kpathsea only searches the working directory, so sources have to be reachable through the environment
+static std::vector<std::string> environment(const path_t &directory) {
+  static constexpr std::string_view VARIABLES[] = { "TEXINPUTS", "BIBINPUTS", "BSTINPUTS" };
+  std::vector<std::string> env;
+  for (char **var = environ; *var; var++) env.emplace_back(*var);
+  if (!options::get().outdir.has_value()) return env;
+  for (auto &&name : VARIABLES) {
+    const char *old = std::getenv(std::string(name).c_str());
+    std::erase_if(env, [&](const std::string &var) { return var.starts_with(name) && var[name.size()] == '='; });
+    env.push_back(fmt::format("{}={}:{}", name, directory.string(), old ? old : ""));
+  }
+  return env;
+}
+
+// copy then rename, so that viewers never see a half written pdf
+static void deliver(const path_t &path, const path_t &workdir) {
+  if (replay::playing()) return; // the stub compiler produces nothing
+  path_t target = path;
+  target.replace_extension(".pdf");
+  const path_t pdf       = workdir / target.filename();
+  const path_t temporary = target.parent_path() / fmt::format(".{}.tmp", target.filename().string());
+  std::error_code ec;
+  std::filesystem::copy_file(pdf, temporary, std::filesystem::copy_options::overwrite_existing, ec);
+  if (!ec) std::filesystem::rename(temporary, target, ec);
+  if (ec) jot::warn("cannot copy `{}` back: {}", pdf.string(), ec.message());
+}
 
 static i32 job_helper(void *arg) {
-  path_t path      = (char *)arg;
-  path_t directory = path.parent_path();
-  std::string base = path.filename().string();
-  std::filesystem::current_path(directory);
+  const spawn_t *spawn = (const spawn_t *)arg;
+  // the watcher blocks the signals it reads through signalfd, compilers must still die on ^C
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, nullptr);
+  if (chdir(spawn->workdir) == -1) {
+    jot::error("job: cannot enter `{}`", spawn->workdir);
+    return EXIT_FAILURE;
+  }
   i32 nullfd = open("/dev/null", O_RDWR);
   if (nullfd == -1) {
     jot::error("job: cannot open /dev/null");
@@ -198,45 +594,232 @@ static i32 job_helper(void *arg) {
   i32 oldstderr = dup(STDERR_FILENO);
   dup2(nullfd, STDOUT_FILENO);
   dup2(nullfd, STDERR_FILENO);
-  char *const argv[] = { "rubber", "--pdf", "--unsafe", (char *)base.c_str(), NULL };
-  execvp("rubber", argv);
+  if (spawn->policy != SCHED_OTHER || spawn->niceness) {
+    sched_attr_t attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size         = sizeof(attr);
+    attr.sched_policy = spawn->policy;
+    attr.sched_nice   = spawn->niceness;
+    // lowering the nice value takes privileges, the policy still applies with the current one
+    if (syscall(SYS_sched_setattr, 0, &attr, 0) == -1 && errno == EPERM) {
+      attr.sched_nice = std::max(spawn->niceness, getpriority(PRIO_PROCESS, 0));
+      syscall(SYS_sched_setattr, 0, &attr, 0);
+    }
+  }
+  if (spawn->ioprio) syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, spawn->ioprio);
+  execvpe(spawn->argv[0], spawn->argv, spawn->envp);
   dup2(oldstdout, STDOUT_FILENO);
   dup2(oldstderr, STDERR_FILENO);
-  jot::error("cannot execute rubber");
+  jot::error("cannot execute {}", spawn->argv[0]);
   return EXIT_FAILURE;
 }
 
-static i32 job(void *arg) {
-  std::unique_ptr<job_t> info = std::make_unique<job_t>(*(job_t *)arg);
-  delete (job_t *)arg;
-  info->mutex->lock();
-  info->mutex->unlock();
+// latex asks for another pass when labels or citations moved
+static bool needs_rerun(const path_t &log) {
+  std::ifstream input(log);
+  std::string line;
+  while (std::getline(input, line))
+    if (line.find("Rerun to get") != std::string::npos) return true;
+  return false;
+}
 
-  char path[NAME_MAX];
-  std::strcpy(path, info->path.c_str());
+// partial stages and previews run pdflatex themselves, with the shell escape rubber's --unsafe allows. documents
+// typeset by another engine (`% rubber: module xelatex`, a `%!TEX program` line, fontspec) are left to rubber
+static bool by_pdflatex(const path_t &path) {
+  std::ifstream input(path);
+  std::string line;
+  auto has = [&](std::string_view what) { return line.find(what) != std::string::npos; };
+  while (std::getline(input, line)) {
+    if (has("xelatex") || has("lualatex") || has("fontspec") || has("unicode-math")) return false;
+    if ((has("TEX program") || has("TS-program")) && !has("pdflatex")) return false;
+    if (has("\\begin{document}")) break;
+  }
+  return true;
+}
+
+static std::vector<step_t> steps_of(const path_t &path, const path_t &workdir, stage_t stage,
+                                    const std::set<path_t> &chapters) {
+  const path_t base = workdir / path.stem();
+  // partial stages and previews rely on the auxiliary files of an earlier full build, and on pdflatex
+  const bool built = std::filesystem::exists(fmt::format("{}.aux", base.string())) && by_pdflatex(path);
+  if (!built) stage = stage_t::full;
+  std::vector<step_t> steps;
+  switch (stage) {
+  case stage_t::full: {
+    // \includeonly names chapters the way \include does, relative to the root and without extension
+    std::string only;
+    for (auto &&chapter : built ? chapters : std::set<path_t>()) {
+      path_t name = chapter.lexically_relative(path.parent_path()).replace_extension();
+      std::error_code ec;
+      std::filesystem::create_directories(workdir / name.parent_path(), ec);
+      if (ec) {
+        jot::warn("preview: skipping `{}`: {}", chapter.string(), ec.message());
+        continue;
+      }
+      only += fmt::format("{}{}", only.empty() ? "" : ",", name.string());
+    }
+    if (only.size()) {
+      const auto input = fmt::format("\\includeonly{{{}}}\\input{{{}}}", only, path.string());
+      steps.push_back({ { "pdflatex", "-interaction=batchmode", "-shell-escape",
+                          fmt::format("-jobname={}", path.stem().string()), input },
+                        false, false });
+      steps.push_back({ { "rubber", "--pdf", "--unsafe", path.string() }, false, true });
+    } else {
+      steps.push_back({ { "rubber", "--pdf", "--unsafe", path.string() }, false, false });
+    }
+    break;
+  }
+  case stage_t::bibliography:
+    if (std::filesystem::exists(fmt::format("{}.bcf", base.string()))) {
+      steps.push_back({ { "biber", path.stem().string() }, false, false });
+    } else {
+      steps.push_back({ { "bibtex", path.stem().string() }, false, false });
+    }
+    [[fallthrough]];
+  case stage_t::final:
+    steps.push_back({ { "pdflatex", "-interaction=batchmode", "-shell-escape", path.string() }, true, false });
+    break;
+  }
+  return steps;
+}
 
-  void *stack = proc_stack::create(STACK_SIZE);
-  struct clone_args options;
-  std::memset(&options, 0, sizeof(options));
-  options.stack       = (u64)stack;
-  options.stack_size  = STACK_SIZE;
-  options.exit_signal = SIGCHLD;
-  options.flags       = CLONE_VM | CLONE_CLEAR_SIGHAND;
+struct job_t {
+  path_t path;
+  path_t workdir;
+  std::vector<std::string> env;
+  std::vector<char *> envp;
+  std::vector<step_t> steps;
+  std::vector<char *> argv;
+  spawn_t spawn; // read by the helper until it execs, so it lives as long as the job
+  std::optional<state_t> key;
+  i32 cgroup;
+  usage_t usage;
+  std::chrono::steady_clock::time_point started;
+  u64 step, reruns;
+  i32 pid, pidfd;
+  void *stack;
+};
 
-  auto child = clone3(&options, sizeof(options), job_helper, path);
+static std::map<path_t, std::unique_ptr<job_t>> jobs;
 
-  siginfo_t status;
-  auto ret = waitid(P_PID, child, &status, WEXITED);
-  proc_stack::release(stack, STACK_SIZE);
-  if (ret) {
+// without cgroups the weights are approximated per process: about 1.25x cpu share per nice level, io levels 0-7
+static i32 niceness_of(u64 weight) {
+  if (weight == 0) return 0;
+  return std::clamp((i32)std::lround(std::log(100.0 / weight) / std::log(1.25)), -20, 19);
+}
+static u16 ioprio_of(u64 weight) {
+  if (weight == 0) return 0;
+  const i32 level = std::clamp((i32)std::lround(4 - 2 * std::log10(weight / 100.0)), 0, 7);
+  return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, level);
+}
+
+static void advance(const path_t &path, i32 pidfd);
+
+// starts the current step of the job, the reactor reports back through its pidfd
+static bool spawn(job_t &job) {
+  job.argv.clear();
+  for (auto &&arg : job.steps[job.step].argv) job.argv.push_back(arg.data());
+  job.argv.push_back(nullptr);
+  // replays measure the pipeline, not latex
+  static char *const STUB[] = { (char *)"true", nullptr };
+  const auto &options = options::get();
+  const bool fallback = options.isolate && job.cgroup == -1 && !replay::playing();
+  const i32 niceness  = fallback ? niceness_of(options.cpu_weight) : 0;
+  job.spawn           = spawn_t{
+    .workdir  = job.workdir.c_str(),
+    .argv     = replay::playing() ? STUB : job.argv.data(),
+    .envp     = job.envp.data(),
+    .niceness = job.steps[job.step].deferred ? std::min(niceness + DEFERRED_NICENESS, 19) : niceness,
+    .policy   = (u32)(fallback ? SCHED_BATCH : SCHED_OTHER),
+    .ioprio   = fallback ? ioprio_of(options.io_weight) : (u16)0,
+  };
+
+  job.stack = proc_stack::create(STACK_SIZE);
+  struct clone_args args;
+  std::memset(&args, 0, sizeof(args));
+  args.stack       = (u64)job.stack;
+  args.stack_size  = STACK_SIZE;
+  args.exit_signal = SIGCHLD;
+  args.pidfd       = (u64)&job.pidfd;
+  args.flags       = CLONE_VM | CLONE_CLEAR_SIGHAND | CLONE_PIDFD;
+  if (job.cgroup != -1) {
+    args.flags |= CLONE_INTO_CGROUP;
+    args.cgroup = job.cgroup;
+  }
+
+  job.pid = clone3(&args, sizeof(args), job_helper, (void *)&job.spawn);
+  if (job.pid < 0) {
+    proc_stack::release(job.stack, STACK_SIZE);
+    jot::error("failed to clone process");
+    return false;
+  }
+  TRACE_EVENT(job__spawn, job.pid, job.path.c_str(), job.step);
+  const path_t path = job.path;
+  const i32 pidfd   = job.pidfd;
+  reactor::watch(pidfd, [path, pidfd](u32) { advance(path, pidfd); });
+  return true;
+}
+
+// reaps the current step, false on a spurious wakeup
+static bool reap(job_t &job, siginfo_t &status, i32 flags = WNOHANG) {
+  // the raw syscall also reports the resources of the step, the fallback when there is no cgroup to ask
+  struct rusage usage;
+  std::memset(&status, 0, sizeof(status));
+  std::memset(&usage, 0, sizeof(usage));
+  if (syscall(SYS_waitid, P_PIDFD, job.pidfd, &status, WEXITED | flags, &usage) == -1) {
     jot::error("job: cannot wait for child process");
-    return EXIT_FAILURE;
+  } else if (status.si_pid == 0) {
+    return false;
+  }
+  TRACE_EVENT(job__exit, status.si_pid, status.si_code, status.si_status);
+  job.usage.memory = std::max<u64>(job.usage.memory, usage.ru_maxrss << 10);
+  job.usage.cpu += (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1'000'000;
+  job.usage.cpu += usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+  reactor::unwatch(job.pidfd);
+  close(job.pidfd);
+  proc_stack::release(job.stack, STACK_SIZE);
+  return true;
+}
+
+static void advance(const path_t &path, i32 pidfd) {
+  if (!jobs.contains(path) || jobs.at(path)->pidfd != pidfd) return;
+  auto &job = *jobs.at(path);
+  siginfo_t status;
+  if (!reap(job, status)) return;
+  const bool ok = status.si_code == CLD_EXITED && status.si_status == EXIT_SUCCESS;
+  // rubber iterates on its own, the bare latex pass is repeated here
+  static constexpr u64 MAX_RERUNS = 3;
+  const bool last = job.step + 1 == job.steps.size();
+  // a step that cannot be started leaves the outputs of the earlier ones, which are not the build asked for
+  bool stranded = false;
+  if (ok && job.steps[job.step].rerun && job.reruns < MAX_RERUNS &&
+      needs_rerun(job.workdir / path_t(job.path.stem()).concat(".log"))) {
+    job.reruns++;
+    if (spawn(job)) return;
+    stranded = true;
+  } else if (ok && !last) {
+    if (job.steps[job.step + 1].deferred) {
+      jot::info("preview completed");
+      if (job.workdir != job.path.parent_path()) deliver(job.path, job.workdir);
+    }
+    job.step++;
+    if (spawn(job)) return;
+    stranded = true;
+  }
+  if (job.cgroup != -1) {
+    const usage_t usage = cgroup::leave(job.cgroup);
+    if (usage.memory) job.usage.memory = usage.memory;
+    if (usage.cpu) job.usage.cpu = usage.cpu;
   }
-  if (status.si_code == CLD_EXITED) {
+  if (stranded) {
+    jot::warn("compilation aborted, step {} of {} did not start", job.step + 1, job.steps.size());
+  } else if (status.si_code == CLD_EXITED) {
     if (status.si_status != EXIT_SUCCESS) {
       jot::warn("compilation terminated with status {}", status.si_status);
     } else {
-      jot::info("compilation completed");
+      jot::info("compilation completed [{} MiB peak, {:.2f}s cpu]", job.usage.memory >> 20, job.usage.cpu / 1e6);
+      if (job.key.has_value()) cache::store(job.key.value(), job.path, job.workdir);
+      if (job.workdir != job.path.parent_path()) deliver(job.path, job.workdir);
     }
   } else if (status.si_code == CLD_KILLED) {
     jot::warn("compilation terminated by signal {}", status.si_status);
@@ -245,58 +828,82 @@ static i32 job(void *arg) {
   } else {
     jot::warn("compilation terminated with unknown status {}", status.si_status);
   }
-
-  std::lock_guard<std::mutex> lock(*info->mutex);
-  info->jobs->at(info->path).done = true;
-  return EXIT_SUCCESS;
+  replay::sample("compile", std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now() - job.started).count());
+  jobs.erase(path);
 }
 
-static void compile(path_t path) {
-  static std::mutex jobs_mutex;
-  static std::map<path_t, job_t> jobs;
+static void terminate(job_t &job) {
+  jot::debug("killing process {}", job.pid);
+  cgroup::kill(job.cgroup);
+  if (syscall(SYS_pidfd_send_signal, job.pidfd, SIGKILL, nullptr, 0) == -1) {
+    jot::warn("failed to kill process {}", job.pid);
+  } else {
+    jot::debug("killed process {}", job.pid);
+  }
+  siginfo_t status;
+  reap(job, status, 0);
+  if (job.cgroup != -1) cgroup::leave(job.cgroup);
+}
 
-  jobs_mutex.lock();
+static void compile(path_t path, stage_t stage, const std::set<path_t> &chapters, const std::set<path_t> &includes,
+                    std::optional<state_t> key) {
   if (jobs.contains(path)) {
-    const auto &info = jobs.at(path);
-    if (!info.done) {
-      jot::debug("already compiling `{}`", path.string());
-      jot::debug("killing process {}", info.pid);
-      if (kill(info.pid, SIGKILL) == -1) {
-        jot::warn("failed to kill process {}", info.pid);
-      } else {
-        jot::debug("killed process {}", info.pid);
-      }
-    }
-    auto ret = waitid(P_PID, info.pid, nullptr, WEXITED);
-    proc_stack::release(info.stack, STACK_SIZE);
-    if (ret) jot::warn("cannot wait job process");
+    jot::debug("already compiling `{}`", path.string());
+    terminate(*jobs.at(path));
     jobs.erase(path);
   }
-  jobs_mutex.unlock();
 
-  job_t *info = new job_t{
-    .pid   = 0,
-    .jobs  = &jobs,
-    .path  = path,
-    .mutex = &jobs_mutex,
-    .stack = proc_stack::create(STACK_SIZE),
-    .done  = false,
-  };
-
-  struct clone_args options;
-  std::memset(&options, 0, sizeof(options));
-  options.stack       = (u64)info->stack;
-  options.stack_size  = STACK_SIZE;
-  options.exit_signal = SIGCHLD;
-  options.flags       = CLONE_VM | CLONE_CLEAR_SIGHAND;
-
-  info->pid = clone3(&options, sizeof(options), job, info);
-  if (info->pid == -1) {
-    proc_stack::release(info->stack, STACK_SIZE);
-    jot::error("failed to clone process");
+  replay::tally("builds");
+  auto job     = std::make_unique<job_t>();
+  job->path    = path;
+  job->workdir = workdir_of(path);
+  std::error_code ec;
+  std::filesystem::create_directories(job->workdir, ec);
+  if (ec) {
+    jot::error("job: cannot create `{}`: {}", job->workdir.string(), ec.message());
+    return;
+  }
+  // outside of the sources, the directories of the included chapters do not exist yet
+  for (auto &&include : includes) {
+    const path_t name = include.lexically_relative(path.parent_path());
+    if (name.empty() || *name.begin() == "..") continue;
+    const path_t directory = job->workdir / name.parent_path();
+    std::filesystem::create_directories(directory, ec);
+    if (ec) jot::warn("job: cannot create `{}`: {}", directory.string(), ec.message());
+  }
+  if (key.has_value() && cache::restore(key.value(), path, job->workdir)) {
+    jot::info("`{}` restored from cache", path.string());
+    if (job->workdir != path.parent_path()) deliver(path, job->workdir);
     return;
   }
-  jobs_mutex.lock();
-  jobs[path] = *info;
-  jobs_mutex.unlock();
-}
\ No newline at end of file
+  job->key    = key;
+  job->cgroup = replay::playing() ? -1 : cgroup::enter();
+  job->usage  = usage_t{ .memory = 0, .cpu = 0 };
+  job->env = environment(path.parent_path());
+  for (auto &&var : job->env) job->envp.push_back(var.data());
+  job->envp.push_back(nullptr);
+  job->steps   = steps_of(path, job->workdir, stage, chapters);
+  job->step    = job->reruns = 0;
+  job->started = std::chrono::steady_clock::now();
+  jot::debug("compiling `{}` in {} step(s)", path.string(), job->steps.size());
+  if (!spawn(*job)) {
+    if (job->cgroup != -1) cgroup::leave(job->cgroup);
+    return;
+  }
+  jobs[path] = std::move(job);
+}
+
+namespace tex {
+bool busy(void) { return !jobs.empty(); }
+void cancel(void) {
+  for (auto &&[path, job] : jobs) terminate(*job);
+  jobs.clear();
+  if (surveyor.joinable()) {
+    abandoned = true;
+    surveyor.join();
+  }
+  if (surveyed != -1) close(surveyed);
+  surveyed = -1;
+}
+} // namespace tex
@@ -0,0 +1,89 @@
+#include <trace.hpp>
+
+extern "C" {
+#include <unistd.h>
+}
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fmt/format.h>
+#include <jot.hpp>
+#include <list>
+#include <mutex>
+#include <vector>
+
+struct mark_t {
+  const char *name;
+  char phase;
+  u64 ts; // microseconds since init
+};
+
+// every thread appends to a buffer of its own, the buffers outlive the threads and are written out at the end
+struct buffer_t {
+  i32 tid;
+  std::vector<mark_t> marks;
+  u64 dropped;
+};
+
+static constexpr u64 MAX_MARKS = 0x40000; // per thread, about 6 MiB; later marks are counted and dropped
+
+static std::filesystem::path target;
+static std::chrono::steady_clock::time_point origin;
+static std::mutex mtx;
+static std::list<buffer_t> buffers;
+
+static void push(const char *name, char phase) {
+  thread_local buffer_t *buffer = nullptr;
+  if (buffer == nullptr) [[unlikely]] {
+    std::lock_guard<std::mutex> lock(mtx);
+    buffer = &buffers.emplace_back(buffer_t{ .tid = gettid(), .marks = {}, .dropped = 0 });
+  }
+  if (buffer->marks.size() == MAX_MARKS) [[unlikely]] {
+    buffer->dropped++;
+    return;
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - origin;
+  buffer->marks.push_back({ name, phase, (u64)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() });
+}
+
+namespace trace {
+std::atomic<bool> active = false;
+
+void init(const std::filesystem::path &path) {
+  target = path;
+  origin = std::chrono::steady_clock::now();
+  active = true;
+}
+void deinit(void) {
+  if (!active) return;
+  active = false;
+  std::lock_guard<std::mutex> lock(mtx);
+  std::FILE *file = std::fopen(target.c_str(), "w");
+  if (file == nullptr) {
+    jot::warn("trace: cannot write `{}`: {}", target.string(), strerror(errno));
+    return;
+  }
+  u64 count = 0, dropped = 0;
+  const i32 pid = getpid();
+  fmt::print(file, "{{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (auto &&buffer : buffers) {
+    dropped += buffer.dropped;
+    for (auto &&mark : buffer.marks) {
+      fmt::print(file, "{}\n{{\"name\":\"{}\",\"ph\":\"{}\",\"ts\":{},\"pid\":{},\"tid\":{}{}}}", count++ ? "," : "",
+                 mark.name, mark.phase, mark.ts, pid, buffer.tid, mark.phase == 'i' ? ",\"s\":\"t\"" : "");
+    }
+  }
+  fmt::print(file, "\n]}}\n");
+  std::fclose(file);
+  jot::info("trace: {} events written to `{}`", count, target.string());
+  if (dropped) jot::warn("trace: {} events dropped, the buffers were full", dropped);
+  // threads keep pointers to their buffers, only the contents go
+  for (auto &&buffer : buffers) {
+    buffer.marks   = {};
+    buffer.dropped = 0;
+  }
+}
+void begin(const char *name) { push(name, 'B'); }
+void end(const char *name) { push(name, 'E'); }
+void instant(const char *name) { push(name, 'i'); }
+} // namespace trace
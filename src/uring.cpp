@@ -0,0 +1,90 @@
+#include <uring.hpp>
+
+extern "C" {
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+}
+#include <algorithm>
+#include <cstring>
+#include <jot.hpp>
+
+uring_t::uring_t(u32 entries) : fd(-1), queued(0), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sqes(nullptr) {
+  struct io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  this->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (this->fd == -1) {
+    jot::debug("uring_t: io_uring_setup failed: {}", strerror(errno));
+    return;
+  }
+  this->sq_entries   = params.sq_entries;
+  this->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+  this->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  this->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    this->sq_ring_size = this->cq_ring_size = std::max(this->sq_ring_size, this->cq_ring_size);
+  }
+  this->sq_ring = mmap(nullptr, this->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd,
+                       IORING_OFF_SQ_RING);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    this->cq_ring = this->sq_ring;
+  } else {
+    this->cq_ring = mmap(nullptr, this->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd,
+                         IORING_OFF_CQ_RING);
+  }
+  void *sqes = mmap(nullptr, this->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd,
+                    IORING_OFF_SQES);
+  if (this->sq_ring == MAP_FAILED || this->cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+    jot::debug("uring_t: mmap failed: {}", strerror(errno));
+    if (sqes != MAP_FAILED) munmap(sqes, this->sqes_size);
+    return;
+  }
+  byte *sq       = (byte *)this->sq_ring;
+  byte *cq       = (byte *)this->cq_ring;
+  this->sq_head  = (u32 *)(sq + params.sq_off.head);
+  this->sq_tail  = (u32 *)(sq + params.sq_off.tail);
+  this->sq_mask  = (u32 *)(sq + params.sq_off.ring_mask);
+  this->sq_array = (u32 *)(sq + params.sq_off.array);
+  this->cq_head  = (u32 *)(cq + params.cq_off.head);
+  this->cq_tail  = (u32 *)(cq + params.cq_off.tail);
+  this->cq_mask  = (u32 *)(cq + params.cq_off.ring_mask);
+  this->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  this->sqes     = (struct io_uring_sqe *)sqes;
+}
+uring_t::~uring_t(void) {
+  if (this->sqes != nullptr) munmap(this->sqes, this->sqes_size);
+  if (this->cq_ring != MAP_FAILED && this->cq_ring != this->sq_ring) munmap(this->cq_ring, this->cq_ring_size);
+  if (this->sq_ring != MAP_FAILED) munmap(this->sq_ring, this->sq_ring_size);
+  if (this->fd != -1) close(this->fd);
+}
+bool uring_t::ok(void) const { return this->sqes != nullptr; }
+struct io_uring_sqe *uring_t::next(void) {
+  const u32 head = __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+  const u32 tail = *this->sq_tail + this->queued;
+  if (tail - head >= this->sq_entries) return nullptr;
+  const u32 index          = tail & *this->sq_mask;
+  this->sq_array[index]    = index;
+  struct io_uring_sqe *sqe = &this->sqes[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  this->queued++;
+  return sqe;
+}
+i32 uring_t::submit(u32 wait) {
+  const u32 count = this->queued;
+  __atomic_store_n(this->sq_tail, *this->sq_tail + count, __ATOMIC_RELEASE);
+  this->queued = 0;
+  i32 ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, this->fd, count, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+  } while (ret == -1 && errno == EINTR);
+  return ret;
+}
+bool uring_t::reap(u64 &data, i32 &res) {
+  const u32 head = *this->cq_head;
+  if (head == __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE)) return false;
+  const struct io_uring_cqe *cqe = &this->cqes[head & *this->cq_mask];
+  data                           = cqe->user_data;
+  res                            = cqe->res;
+  __atomic_store_n(this->cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
@@ -1,13 +1,37 @@
 #include <watcher.hpp>
 
+#include <algorithm>
+#include <cstring>
 #include <jot.hpp>
+#include <meta.hpp>
+#include <poller.hpp>
+#include <replay.hpp>
+#include <trace.hpp>
+#include <vector>
 extern "C" {
+#include <fcntl.h>
+#include <linux/magic.h>
 #include <sys/inotify.h>
+#include <sys/vfs.h>
+#include <unistd.h>
 }
 
-watcher_t::watcher_t(void) : events_semaphore(0) {
-  this->fd = inotify_init();
-  this->running.store(false);
+// only the events acted upon in `main`, everything else is noise from our own builds and from readers
+// moves away only matter to the metadata cache of the analyzer
+static constexpr u32 WATCH_MASK =
+  IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_ONLYDIR;
+// where a source may only appear: creations and renames, no writes
+static constexpr u32 CHEAP_MASK = IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF | IN_ONLYDIR;
+
+static bool is_within(const std::filesystem::path &path, const std::filesystem::path &base) {
+  auto [end, _] = std::mismatch(base.begin(), base.end(), path.begin(), path.end());
+  return end == base.end();
+}
+
+watcher_t::watcher_t(void) {
+  this->fd      = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  this->running = false;
+  this->sparse  = false;
   while (this->events.size()) this->events.pop();
   this->nodes.clear();
 }
@@ -15,78 +39,266 @@ watcher_t::~watcher_t(void) {
   this->stop();
   close(this->fd);
 }
+bool watcher_t::skipped(const std::filesystem::path &path) const {
+  if (path.string().find("node_modules") != std::string::npos) return true;
+  for (auto &&base : this->excluded)
+    if (is_within(path, base)) return true;
+  return false;
+}
+// adds the watch or changes its mask, the kernel keeps the descriptor in the latter case
+void watcher_t::set(const std::filesystem::path &path, u32 mask, bool frontier) {
+  auto it = this->watches.find(path);
+  if (it != this->watches.end() && it->second.mask == mask) {
+    it->second.frontier = frontier;
+    return;
+  }
+  i32 wd = inotify_add_watch(this->fd, path.c_str(), mask);
+  if (wd == -1) {
+    jot::warn("watcher_t::add: failed to add path `{}`: {}", path.string(), strerror(errno));
+    return;
+  }
+  jot::debug("watching `{}`{}", path.string(), mask == WATCH_MASK ? "" : " for creations");
+  this->nodes[wd]     = path;
+  this->watches[path] = watch_t{ .wd = wd, .mask = mask, .frontier = frontier };
+  meta::watch(path, mask == WATCH_MASK);
+  replay::watched(wd, path);
+}
+// watches of the directories below `path`, and of `path` itself with `self`; descendants sort right after it
+void watcher_t::drop(const std::filesystem::path &path, bool self) {
+  auto it = this->watches.lower_bound(path);
+  while (it != this->watches.end() && is_within(it->first, path)) {
+    if (!self && it->first == path) {
+      it++;
+      continue;
+    }
+    // fails harmlessly when the kernel dropped the watch already, along with the directory
+    inotify_rm_watch(this->fd, it->second.wd);
+    jot::debug("unwatching `{}`", it->first.string());
+    meta::unwatch(it->first);
+    this->nodes.erase(it->second.wd);
+    it = this->watches.erase(it);
+  }
+}
+// sparse mode: full watches where sources or pinned files are, cheap ones on the directories leading there and on
+// the first level below all of them, nothing further down. true when the subtree holds something
+bool watcher_t::shape(const std::filesystem::path &path) {
+  bool sources = this->pinned.contains(path), relevant = false;
+  std::vector<std::filesystem::path> others;
+  std::error_code ec;
+  for (auto &&entry : std::filesystem::directory_iterator(path, ec)) {
+    if (entry.is_directory(ec)) {
+      if (this->skipped(entry.path())) continue;
+      if (this->shape(entry.path())) {
+        relevant = true;
+      } else {
+        others.push_back(entry.path());
+      }
+    } else if (entry.path().extension() == ".tex") {
+      sources = true;
+    }
+  }
+  if (!sources && !relevant) return false;
+  this->set(path, sources ? WATCH_MASK : CHEAP_MASK, false);
+  for (auto &&other : others) {
+    this->drop(other, false);
+    this->set(other, CHEAP_MASK, true);
+  }
+  return true;
+}
+// nobody has the file open for writing: a read lease is refused while there is a writer. when leases are not
+// available at all the file is taken as it is. a writer showing up meanwhile breaks the lease with SIGIO, which main
+// keeps blocked
+static bool complete(const std::filesystem::path &path) {
+  const i32 fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+  if (fd == -1) return false;
+  const bool busy = fcntl(fd, F_SETLEASE, F_RDLCK) == -1 && errno == EAGAIN;
+  if (!busy) fcntl(fd, F_SETLEASE, F_UNLCK);
+  close(fd);
+  return !busy;
+}
+
+// turns `path` into a full watch, and the directories leading to it from frontier or nothing into cheap ones
+void watcher_t::promote(const std::filesystem::path &path) {
+  if (this->skipped(path) || std::none_of(this->tops.begin(), this->tops.end(), [&](auto &&top) {
+        return is_within(path, top);
+      }))
+    return;
+  std::error_code ec;
+  auto frontier = [&](const std::filesystem::path &directory) {
+    for (auto &&entry : std::filesystem::directory_iterator(directory, ec))
+      if (entry.is_directory(ec) && !this->watches.contains(entry.path()) && !this->skipped(entry.path()))
+        this->set(entry.path(), CHEAP_MASK, true);
+  };
+  this->set(path, WATCH_MASK, false);
+  frontier(path);
+  for (auto up = path; !this->tops.contains(up);) {
+    up      = up.parent_path();
+    auto it = this->watches.find(up);
+    if (it != this->watches.end() && !it->second.frontier) break;
+    this->set(up, CHEAP_MASK, false);
+    frontier(up);
+  }
+}
+
 void watcher_t::add(std::filesystem::path path, bool recursive) {
+  // replayed events come with the watches of the recording
+  if (replay::playing()) return;
   path = std::filesystem::canonical(path);
   path = std::filesystem::absolute(path);
-  jot::debug("watching `{}`", path.string());
-  if (path.string().find("node_modules") != std::string::npos) return;
+  if (this->skipped(path)) return;
   if (!std::filesystem::exists(path)) {
     jot::warn("watcher_t::add: path `{}` does not exist", path.string());
     return;
   }
+  if (this->poller) {
+    if (!std::filesystem::is_directory(path)) return;
+    std::error_code ec;
+    if (recursive)
+      for (auto &&entry : std::filesystem::directory_iterator(path, ec))
+        if (entry.is_directory(ec)) this->add(entry, recursive);
+    // a directory found by a scan may have been filled before it was polled, unlike the tree given at startup
+    this->poller->add(path, this->running ? &this->events : nullptr);
+    return;
+  }
+  const bool top = std::none_of(this->tops.begin(), this->tops.end(), [&](auto &&top) { return is_within(path, top); });
+  if (top) this->tops.insert(path);
+  if (this->sparse && std::filesystem::is_directory(path)) {
+    if (this->shape(path)) {
+      if (!top) this->promote(path.parent_path());
+      return;
+    }
+    // nothing in there yet, only watched when it hangs right below a directory that matters
+    auto parent = this->watches.find(path.parent_path());
+    if (top || (parent != this->watches.end() && !parent->second.frontier)) this->set(path, CHEAP_MASK, !top);
+    return;
+  }
   if (recursive && std::filesystem::is_directory(path)) {
     for (auto &&entry : std::filesystem::directory_iterator(path)) {
       if (std::filesystem::is_directory(entry)) this->add(entry, recursive);
     }
   }
-  i32 wd = inotify_add_watch(this->fd, path.c_str(), IN_ALL_EVENTS);
-  if (wd == -1) {
-    jot::warn("watcher_t::add: failed to add path `{}`", path.string());
+  this->set(path, WATCH_MASK, false);
+}
+void watcher_t::remove(std::filesystem::path path, bool recursive) {
+  path = std::filesystem::absolute(path);
+  if (this->poller) {
+    this->poller->remove(path);
+    return;
+  }
+  if (recursive) {
+    this->drop(path, true);
     return;
   }
-  std::lock_guard<std::mutex> lock(this->nodes_mutex);
-  this->nodes[wd] = path;
+  auto it = this->watches.find(path);
+  if (it == this->watches.end()) return;
+  inotify_rm_watch(this->fd, it->second.wd);
+  meta::unwatch(it->first);
+  this->nodes.erase(it->second.wd);
+  this->watches.erase(it);
+}
+void watcher_t::exclude(std::filesystem::path path) {
+  path = std::filesystem::absolute(path);
+  jot::debug("excluding `{}`", path.string());
+  this->excluded.insert(path);
 }
-void watcher_t::remove(std::filesystem::path path, bool recursive) { die("not implemented"); }
-void watcher_t::start(void) {
-  if (this->running.exchange(true)) return;
-  this->antenna = std::thread([this]() { this->depot(); });
+void watcher_t::sparsify(void) { this->sparse = true; }
+void watcher_t::use_polling(void) { this->poller = std::make_unique<poller_t>(); }
+bool watcher_t::supported(const std::filesystem::path &path) {
+  static constexpr i64 BLIND[] = {
+    NFS_SUPER_MAGIC,  SMB_SUPER_MAGIC, CIFS_SUPER_MAGIC, SMB2_SUPER_MAGIC,
+    FUSE_SUPER_MAGIC, V9FS_MAGIC,      CEPH_SUPER_MAGIC,
+  };
+  struct statfs fs;
+  if (statfs(path.c_str(), &fs) == -1) return true;
+  return std::find(std::begin(BLIND), std::end(BLIND), (i64)(u32)fs.f_type) == std::end(BLIND);
 }
+void watcher_t::pin(const std::filesystem::path &directory) {
+  if (!this->sparse || this->poller || replay::playing()) return;
+  if (this->pinned.insert(directory).second && std::filesystem::is_directory(directory)) this->promote(directory);
+}
+// back to a cheap watch, unless the directory holds sources of its own
+void watcher_t::unpin(const std::filesystem::path &directory) {
+  if (!this->pinned.erase(directory)) return;
+  auto it = this->watches.find(directory);
+  if (it == this->watches.end() || it->second.mask != WATCH_MASK) return;
+  std::error_code ec;
+  for (auto &&entry : std::filesystem::directory_iterator(directory, ec))
+    if (entry.path().extension() == ".tex") return;
+  this->set(directory, CHEAP_MASK, false);
+}
+void watcher_t::start(void) { this->running = true; }
 void watcher_t::stop(void) {
-  if (!this->running.exchange(false)) return;
-  this->antenna.join();
+  if (this->running && this->poller) this->poller->report();
+  this->running = false;
+}
+i32 watcher_t::handle(void) const {
+  if (replay::playing()) return replay::handle();
+  return this->poller ? this->poller->handle() : this->fd;
 }
-event_t watcher_t::poll(void) {
-  if (!this->running.load()) {
+std::optional<event_t> watcher_t::poll(void) {
+  if (!this->running) {
     jot::warn("watcher_t::poll: watcher is not running");
-    return { std::filesystem::path(), 0 };
+    return std::nullopt;
   }
-  this->events_semaphore.acquire();
-  std::lock_guard<std::mutex> lock(this->events_mutex);
+  if (this->events.empty() && !this->depot()) return std::nullopt;
   event_t event = this->events.front();
   this->events.pop();
+  TRACE_EVENT(event__dequeue, event.mask, event.path.c_str());
   return event;
 }
 
-void watcher_t::depot(void) {
+// drains what inotify has right now, false when there was nothing to read
+bool watcher_t::depot(void) {
+  if (replay::playing()) return replay::due(this->events);
+  if (this->poller) return this->poller->scan(this->events);
   static constexpr u64 BUFFER_SIZE = 0x10000;
-  byte *buffer                     = new byte[BUFFER_SIZE];
-  while (this->running.load()) {
-    i64 length = read(this->fd, buffer, BUFFER_SIZE);
-    if (length == -1) {
-      this->running.store(false);
-      die("watcher_t::depot: failed to read from inotify");
-    }
-    if (length == 0) {
-      this->running.store(false);
-      die("watcher_t::depot: inotify has been closed");
+  alignas(struct inotify_event) static byte buffer[BUFFER_SIZE];
+  i64 length = read(this->fd, buffer, BUFFER_SIZE);
+  if (length == -1) {
+    if (errno == EAGAIN || errno == EINTR) return false;
+    this->running = false;
+    die("watcher_t::depot: failed to read from inotify");
+  }
+  if (length == 0) {
+    this->running = false;
+    die("watcher_t::depot: inotify has been closed");
+  }
+  i64 offset = 0;
+  while (offset < length) {
+    struct inotify_event *event = (struct inotify_event *)(buffer + offset);
+    replay::observed(event);
+    offset += sizeof(*event) + event->len;
+    if (static_cast<u64>(offset) > BUFFER_SIZE) {
+      this->running = false;
+      die("watcher_t::depot: buffer overflow");
     }
-    i64 offset = 0;
-    while (offset < length) {
-      struct inotify_event *event = (struct inotify_event *)(buffer + offset);
-      this->nodes_mutex.lock();
-      std::filesystem::path path = this->nodes[event->wd];
-      this->nodes_mutex.unlock();
-      if (event->len) { path /= event->name; }
-      offset += sizeof(*event) + event->len;
-      if (static_cast<u64>(offset) > BUFFER_SIZE) {
-        this->running.store(false);
-        die("watcher_t::depot: buffer overflow");
+    // late events of a watch removed on purpose
+    const auto node = this->nodes.find(event->wd);
+    if (node == this->nodes.end() && event->wd != -1) continue;
+    std::filesystem::path path = event->wd == -1 ? std::filesystem::path() : node->second;
+    if (event->len) { path /= event->name; }
+    TRACE_EVENT(event__read, event->wd, event->mask, path.c_str());
+    this->events.push(event_t{ path, event->mask });
+    if (event->mask & IN_IGNORED) {
+      const auto it = this->watches.find(node->second);
+      if (it != this->watches.end() && it->second.wd == event->wd) {
+        meta::unwatch(it->first);
+        this->watches.erase(it);
       }
-      std::lock_guard<std::mutex> lock(this->events_mutex);
-      this->events.push(event_t{ path, event->mask });
-      this->events_semaphore.release();
+      this->nodes.erase(node);
+      continue;
+    }
+    // a source showing up where only creations were watched: the directory gets a full watch from now on. sources
+    // already closed by then are reported as written, those still being written report themselves
+    if (this->sparse && !(event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+        path.extension() == ".tex" && this->watches.contains(node->second) &&
+        this->watches.at(node->second).mask != WATCH_MASK) {
+      this->promote(node->second);
+      std::error_code ec;
+      for (auto &&entry : std::filesystem::directory_iterator(node->second, ec))
+        if (entry.path().extension() == ".tex" && entry.is_regular_file(ec) && complete(entry.path()))
+          this->events.push(event_t{ entry.path(), IN_CLOSE_WRITE });
     }
   }
-  delete[] buffer;
-}
\ No newline at end of file
+  return true;
+}